@@ -0,0 +1,224 @@
+# frozen_string_literal: true
+#
+# Reports objects allocated, bytes allocated and GC runs per million
+# operations for the public StringScanner methods, and fails when the
+# number of objects allocated per operation grows beyond its threshold.
+#
+#   rake benchmark:allocation
+#
+# Set STRSCAN_ALLOCATION_OPERATIONS to change the number of operations
+# measured for each method.
+
+require "strscan"
+
+N_OPERATIONS = Integer(ENV["STRSCAN_ALLOCATION_OPERATIONS"] || 100_000)
+
+# The thresholds are the counts measured on Ruby 3.3.  Older Rubies may
+# allocate an object more in places, such as the Hash of keyword arguments
+# passed to a C method, so they're allowed one more per operation.
+HEADROOM = RUBY_VERSION >= "3.3" ? 0 : 1
+
+BUFFER = []
+DATE = Struct.new(:wday, :month, :day).new
+DELIMITERS = ["<%", "${", /\n/]
+KEYWORDS = {"if" => :if, "else" => :else, "end" => :end}
+RULES = [/\d+/, /\w+/, /\s+/, "+", "*"]
+TOKENS = String.new
+
+# name => [maximum objects per operation, scanner factory, operation]
+CASES = {
+  "new" => [
+    1,
+    -> { nil },
+    ->(_) { StringScanner.new("test string").skip(/\w+/) },
+  ],
+  "reset_with" => [
+    0,
+    -> { StringScanner.new("test string") },
+    ->(s) { s.reset_with("test string").skip(/\w+/) },
+  ],
+  "scan(Regexp)" => [
+    1,
+    -> { StringScanner.new("test string") },
+    ->(s) { s.pos = 0; s.scan(/\w+/) },
+  ],
+  "scan(String)" => [
+    1,
+    -> { StringScanner.new("test string") },
+    ->(s) { s.pos = 0; s.scan("test") },
+  ],
+  "skip" => [
+    0,
+    -> { StringScanner.new("test string") },
+    ->(s) { s.pos = 0; s.skip(/\w+/) },
+  ],
+  "match?" => [
+    0,
+    -> { StringScanner.new("test string") },
+    ->(s) { s.match?(/\w+/) },
+  ],
+  "captures" => [
+    4,
+    -> { s = StringScanner.new("Fri Dec 12 1975"); s.scan(/(\w+) (\w+) (\d+)/); s },
+    ->(s) { s.captures },
+  ],
+  "values_at" => [
+    4,
+    -> { s = StringScanner.new("Fri Dec 12 1975"); s.scan(/(\w+) (\w+) (\d+)/); s },
+    ->(s) { s.values_at(0, 1, 2) },
+  ],
+  "captures_into" => [
+    3,
+    -> { s = StringScanner.new("Fri Dec 12 1975"); s.scan(/(\w+) (\w+) (\d+)/); s },
+    ->(s) { s.captures_into(BUFFER) },
+  ],
+  "captures_into(span)" => [
+    2,
+    -> { s = StringScanner.new("Fri Dec 12 1975"); s.scan(/(\w+) (\w+) (\d+)/); s },
+    ->(s) { s.captures_into(BUFFER, mode: :span) },
+  ],
+  "values_at_into" => [
+    3,
+    -> { s = StringScanner.new("Fri Dec 12 1975"); s.scan(/(\w+) (\w+) (\d+)/); s },
+    ->(s) { s.values_at_into(BUFFER, 0, 1, 2) },
+  ],
+  "named_captures" => [
+    4,
+    -> { s = StringScanner.new("Fri Dec 12 1975"); s.scan(/(?<wday>\w+) (?<month>\w+) (?<day>\d+)/); s },
+    ->(s) { s.named_captures },
+  ],
+  "named_captures_into" => [
+    3,
+    -> { s = StringScanner.new("Fri Dec 12 1975"); s.scan(/(?<wday>\w+) (?<month>\w+) (?<day>\d+)/); s },
+    ->(s) { s.named_captures_into(DATE) },
+  ],
+  "scan_until_any" => [
+    1,
+    -> { StringScanner.new("Hello ${name}, <%= n %>") },
+    ->(s) { s.pos = 0; s.scan_until_any(DELIMITERS) },
+  ],
+  "scan_fields" => [
+    4,
+    -> { StringScanner.new("Fri,Dec,12\n") },
+    ->(s) { s.pos = 0; s.scan_fields },
+  ],
+  "scan_fields(span)" => [
+    3,
+    -> { StringScanner.new("Fri,Dec,12\n") },
+    ->(s) { s.pos = 0; s.scan_fields(mode: :span) },
+  ],
+  "scan_ident_in(hit)" => [
+    0,
+    -> { StringScanner.new("else x") },
+    ->(s) { s.pos = 0; s.scan_ident_in(KEYWORDS) },
+  ],
+  "scan_ident_in(miss)" => [
+    1,
+    -> { StringScanner.new("x else") },
+    ->(s) { s.pos = 0; s.scan_ident_in(KEYWORDS) },
+  ],
+  "skip_trivia" => [
+    0,
+    -> { StringScanner.new("  // note\n  /* block */ x") },
+    ->(s) { s.pos = 0; s.skip_trivia(:c) },
+  ],
+  "tokenize" => [
+    0,
+    -> { StringScanner.new("sum + 42 * x") },
+    ->(s) { s.pos = 0; TOKENS.clear; s.tokenize(RULES, TOKENS) },
+  ],
+  "scan_u32" => [
+    0,
+    -> { StringScanner.new("\x00\x00\x01\x00".b) },
+    ->(s) { s.pos = 0; s.scan_u32 },
+  ],
+  "scan_varint" => [
+    0,
+    -> { StringScanner.new("\x96\x01".b) },
+    ->(s) { s.pos = 0; s.scan_varint },
+  ],
+  "rest" => [
+    1,
+    -> { s = StringScanner.new("test string"); s.pos = 5; s },
+    ->(s) { s.rest },
+  ],
+  "peek" => [
+    1,
+    -> { StringScanner.new("test string") },
+    ->(s) { s.peek(4) },
+  ],
+  "peek_byte" => [
+    0,
+    -> { StringScanner.new("test string") },
+    ->(s) { s.peek_byte },
+  ],
+  "peek_eq?" => [
+    0,
+    -> { StringScanner.new("test string") },
+    ->(s) { s.peek_eq?("te") },
+  ],
+  "peek_in?" => [
+    0,
+    -> { StringScanner.new("test string") },
+    ->(s) { s.peek_in?("abcdefghijklmnopqrstuvwxyz") },
+  ],
+  "inspect" => [
+    6,
+    -> { s = StringScanner.new("test string"); s.pos = 5; s },
+    ->(s) { s.inspect },
+  ],
+}
+
+def allocated_bytes
+  if GC.respond_to?(:stat_heap)
+    GC.stat_heap.sum do |_, heap|
+      heap[:total_allocated_objects] * heap[:slot_size]
+    end
+  else
+    GC.stat(:total_allocated_objects) * GC::INTERNAL_CONSTANTS[:RVALUE_SIZE]
+  end
+end
+
+def measure(scanner, operation, n)
+  GC.start
+  bytes = allocated_bytes
+  objects = GC.stat(:total_allocated_objects)
+  count = GC.count
+  i = 0
+  while i < n
+    operation.call(scanner)
+    i += 1
+  end
+  [
+    GC.stat(:total_allocated_objects) - objects,
+    allocated_bytes - bytes,
+    GC.count - count,
+  ]
+end
+
+scale = 1_000_000.0 / N_OPERATIONS
+failures = []
+puts format("%-20s %12s %14s %10s %12s",
+            "method", "objects/1M", "bytes/1M", "GC/1M", "objects/op")
+CASES.each do |name, (threshold, factory, operation)|
+  scanner = factory.call
+  measure(scanner, operation, 1_000) # warm up caches
+  objects, bytes, gc_runs = measure(scanner, operation, N_OPERATIONS)
+  per_operation = objects.fdiv(N_OPERATIONS)
+  puts format("%-20s %12d %14d %10d %12.2f",
+              name, objects * scale, bytes * scale, gc_runs * scale,
+              per_operation)
+  if per_operation > threshold + HEADROOM + 0.01
+    failures << "#{name}: #{'%.2f' % per_operation} objects/op " +
+                "(threshold: #{threshold + HEADROOM})"
+  end
+end
+
+unless failures.empty?
+  puts
+  puts "Allocation regressions:"
+  failures.each do |failure|
+    puts "  #{failure}"
+  end
+  exit(false)
+end
@@ -2,4 +2,11 @@
 require 'mkmf'
 $INCFLAGS << " -I$(top_srcdir)" if $extmk
 have_func("onig_region_memsize", "ruby.h")
+have_func("onig_memsize", "ruby.h")
+have_func("rb_keyword_given_p", "ruby.h")
+have_struct_member("struct re_pattern_buffer", "timelimit", ["ruby.h", "ruby/onigmo.h"])
+have_func("rb_io_buffer_get_bytes_for_writing", "ruby/io/buffer.h")
+# strscan.h goes with Ruby's headers in a Ruby build, or next to
+# strscan.so in a gem's extension directory; see strscan.h.
+$INSTALLFILES = {"strscan.h" => $extmk ? "$(HDRDIR)" : "$(RUBYARCHDIR)"}
 create_makefile 'strscan'
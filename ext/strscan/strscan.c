@@ -11,6 +11,8 @@
 #include "ruby/ruby.h"
 #include "ruby/re.h"
 #include "ruby/encoding.h"
+#define RB_STRSCAN_EXPORT 1
+#include "strscan.h"
 
 #ifdef RUBY_EXTCONF_H
 #  include RUBY_EXTCONF_H
@@ -19,8 +21,27 @@
 #ifdef HAVE_ONIG_REGION_MEMSIZE
 extern size_t onig_region_memsize(const struct re_registers *regs);
 #endif
+#ifdef HAVE_ONIG_MEMSIZE
+extern size_t onig_memsize(const regex_t *reg);
+#endif
+
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_WRITING
+#  include "ruby/io/buffer.h"
+#endif
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifndef ALWAYS_INLINE
+#  define ALWAYS_INLINE(x) x
+#endif
+#ifndef NOINLINE
+#  define NOINLINE(x) x
+#endif
+#ifndef RB_UNUSED_VAR
+#  define RB_UNUSED_VAR(x) x
+#endif
 
 #define STRSCAN_VERSION "3.0.0"
 
@@ -30,42 +51,178 @@ extern size_t onig_region_memsize(const struct re_registers *regs);
 
 static VALUE StringScanner;
 static VALUE ScanError;
+static VALUE MatchLimitError;
+static VALUE RegexpTimeoutError = Qnil;
 static ID id_byteslice;
 
+/* the number of re-encoded regexps kept by each scanner */
+#define REGEXP_CACHE_SIZE 8
+
 struct strscanner
 {
     /* multi-purpose flags */
     unsigned long flags;
 #define FLAG_MATCHED (1 << 0)
+#define FLAG_INLINE_REGS (1 << 1)
+#define FLAG_LIMITED (1 << 2)
+#define FLAG_ABSOLUTE_REGS (1 << 3)
+#define FLAG_PATTERN_INDEX (1 << 4)
+#define FLAG_FROZEN_STR (1 << 5)
 
     /* the string to scan */
     VALUE str;
 
+    /* RSTRING_PTR(str) and scan_length(), cached while str is frozen;
+       legal only when FROZEN_STR_P(s) */
+    const char *str_ptr;
+    long str_len;
+
     /* scan pointers */
     long prev;   /* legal only when MATCHED_P(s) */
     long curr;   /* always legal */
+    long limit;  /* logical end of str; legal only when LIMITED_P(s) */
+    /* bumped when str is set or edited by #replace; see with_limit */
+    unsigned long str_generation;
 
-    /* the regexp register; legal only when MATCHED_P(s) */
+    /* the regexp register; legal only when MATCHED_P(s) and
+       not INLINE_REGS_P(s) */
     struct re_registers regs;
 
+    /* group 0 of the last match; legal only when MATCHED_P(s) and
+       INLINE_REGS_P(s).  Literal, byte and capture-less regexp matches
+       only need this, so regs isn't allocated for them. */
+    long beg0;
+    long end0;
+
+    /* index of the pattern matched by scan_until_any; legal only when
+       PATTERN_INDEX_P(s) */
+    long pattern_index;
+
     /* regexp used for last scan */
     VALUE regex;
 
+    /* named groups of named_groups_regex; see named_groups() */
+    VALUE named_groups_regex;
+    VALUE named_groups;
+
+    /* named groups for each member of named_groups_struct */
+    VALUE named_groups_struct;
+    VALUE named_groups_members;
+
+    /* scratch key for looking identifiers up by scan_ident_in */
+    VALUE ident_key;
+
+    /* private copies of the regexps matched under timelimit;
+       see timed_regexp() */
+    VALUE timed_regexps;
+
+    /* sorted token boundaries recorded by checkpoint */
+    long *checkpoints;
+    long n_checkpoints;
+    long checkpoints_capa;
+    /* the position of the last checkpoint call, or -1 */
+    long last_checkpoint;
+
     /* anchor mode */
     bool fixed_anchor_p;
+
+    /* how many bytes before the scan pointer regexps may look at in fixed
+       anchor mode, or -1 for the whole string */
+    long lookbehind_window;
+
+    /* a character boundary near the start of the lookbehind window; see
+       match_target_offset() */
+    long window_head;
+
+    /* time limit of regexp matches in nanoseconds, or 0 for Regexp's own */
+    uint64_t timelimit;
+
+    /* regexps compiled again for the encoding of str, least recently used
+       first out; see prepare_regexp() */
+    struct regexp_cache_entry *regexp_cache;
+    int n_regexp_cache;
+    unsigned long regexp_cache_clock;
+    unsigned long regexp_cache_hits;
+    unsigned long regexp_cache_misses;
+};
+
+struct regexp_cache_entry {
+    /* the source, options and encoding of the Regexp, and the encoding
+       of the string it was compiled for */
+    char *source;
+    long source_len;
+    int options;
+    int pattern_encindex;
+    int str_encindex;
+    int str_coderange;
+    regex_t *re;
+    unsigned long used;
 };
 
 #define MATCHED_P(s)          ((s)->flags & FLAG_MATCHED)
 #define MATCHED(s)             (s)->flags |= FLAG_MATCHED
-#define CLEAR_MATCH_STATUS(s)  (s)->flags &= ~FLAG_MATCHED
+#define CLEAR_MATCH_STATUS(s)  (s)->flags &= ~(FLAG_MATCHED | FLAG_ABSOLUTE_REGS | FLAG_PATTERN_INDEX)
+
+/* The registers are relative to the beginning of the string even if not
+   fixed_anchor_p.  Set by the backward scanning methods, which leave prev
+   at the position they started from. */
+#define ABSOLUTE_REGS_P(s)    ((s)->flags & FLAG_ABSOLUTE_REGS)
+#define ABSOLUTE_REGS(s)       (s)->flags |= FLAG_ABSOLUTE_REGS
+
+#define PATTERN_INDEX_P(s)    ((s)->flags & FLAG_PATTERN_INDEX)
+#define PATTERN_INDEX(s)       (s)->flags |= FLAG_PATTERN_INDEX
+
+#define INLINE_REGS_P(s)      ((s)->flags & FLAG_INLINE_REGS)
+#define INLINE_REGS(s)         (s)->flags |= FLAG_INLINE_REGS
+#define CLEAR_INLINE_REGS(s)   (s)->flags &= ~FLAG_INLINE_REGS
+
+/* The string can't change, nor can it move as it's marked (pinned), so
+   the access macros below use str_ptr and str_len instead of loading them
+   from the RString on every use.  See cache_string(). */
+#define FROZEN_STR_P(s)       ((s)->flags & FLAG_FROZEN_STR)
+
+#define LIMITED_P(s)          ((s)->flags & FLAG_LIMITED)
+#define LIMITED(s)             (s)->flags |= FLAG_LIMITED
+#define CLEAR_LIMITED(s)       (s)->flags &= ~FLAG_LIMITED
+
+#define NUM_REGS(s)  (INLINE_REGS_P(s) ? 1 : (s)->regs.num_regs)
+#define REG_BEG(s, i)  (INLINE_REGS_P(s) ? (s)->beg0 : (s)->regs.beg[i])
+#define REG_END(s, i)  (INLINE_REGS_P(s) ? (s)->end0 : (s)->regs.end[i])
+#define REGS_OR_NULL(s)  (INLINE_REGS_P(s) ? NULL : &((s)->regs))
+
+static inline long
+scan_length(struct strscanner *p)
+{
+    long len;
 
-#define S_PBEG(s)  (RSTRING_PTR((s)->str))
-#define S_LEN(s)  (RSTRING_LEN((s)->str))
+    if (FROZEN_STR_P(p)) return p->str_len;
+    len = RSTRING_LEN(p->str);
+    if (LIMITED_P(p) && p->limit < len) return p->limit;
+    return len;
+}
+
+/* Updates str_ptr and str_len; call it whenever str or limit changes. */
+static void
+cache_string(struct strscanner *p)
+{
+    p->flags &= ~FLAG_FROZEN_STR;
+    if (NIL_P(p->str) || !OBJ_FROZEN(p->str)) return;
+    p->str_ptr = RSTRING_PTR(p->str);
+    p->str_len = scan_length(p);
+    p->flags |= FLAG_FROZEN_STR;
+}
+
+#define S_PBEG(s)  (FROZEN_STR_P(s) ? (s)->str_ptr : RSTRING_PTR((s)->str))
+#define S_LEN(s)  (scan_length(s))
 #define S_PEND(s)  (S_PBEG(s) + S_LEN(s))
 #define CURPTR(s) (S_PBEG(s) + (s)->curr)
 #define S_RESTLEN(s) (S_LEN(s) - (s)->curr)
 
-#define EOS_P(s) ((s)->curr >= RSTRING_LEN(p->str))
+#define EOS_P(s) ((s)->curr >= S_LEN(s))
+
+/* The coderange is computed when the string is attached and is cleared
+   by Ruby whenever the string is modified, so this can't go stale. */
+#define ASCII_ONLY_P(s) (ENC_CODERANGE((s)->str) == ENC_CODERANGE_7BIT)
 
 #define GET_SCANNER(obj,var) do {\
     (var) = check_strscan(obj);\
@@ -87,6 +244,8 @@ static size_t strscan_memsize _((const void *p));
 static VALUE strscan_s_allocate _((VALUE klass));
 static VALUE strscan_initialize _((int argc, VALUE *argv, VALUE self));
 static VALUE strscan_init_copy _((VALUE vself, VALUE vorig));
+static VALUE strscan_reset_with _((int argc, VALUE *argv, VALUE self));
+static VALUE strscan_s_each_token _((int argc, VALUE *argv, VALUE klass));
 
 static VALUE strscan_s_mustc _((VALUE self));
 static VALUE strscan_terminate _((VALUE self));
@@ -96,25 +255,54 @@ static VALUE strscan_set_string _((VALUE self, VALUE str));
 static VALUE strscan_concat _((VALUE self, VALUE str));
 static VALUE strscan_get_pos _((VALUE self));
 static VALUE strscan_set_pos _((VALUE self, VALUE pos));
-static VALUE strscan_do_scan _((VALUE self, VALUE regex,
-                                int succptr, int getstr, int headonly));
-static VALUE strscan_scan _((VALUE self, VALUE re));
-static VALUE strscan_match_p _((VALUE self, VALUE re));
-static VALUE strscan_skip _((VALUE self, VALUE re));
-static VALUE strscan_check _((VALUE self, VALUE re));
+static VALUE strscan_get_limit _((VALUE self));
+static VALUE strscan_set_limit _((VALUE self, VALUE limit));
+static VALUE strscan_with_limit _((VALUE self, VALUE limit));
+ALWAYS_INLINE(static VALUE strscan_do_scan _((VALUE self, VALUE regex,
+                                              int succptr, int getstr,
+                                              int headonly, int ignore_case)));
+static VALUE strscan_scan _((int argc, VALUE *argv, VALUE self));
+static VALUE strscan_match_p _((int argc, VALUE *argv, VALUE self));
+static VALUE strscan_skip _((int argc, VALUE *argv, VALUE self));
+static VALUE strscan_check _((int argc, VALUE *argv, VALUE self));
 static VALUE strscan_scan_full _((VALUE self, VALUE re,
                                   VALUE succp, VALUE getp));
-static VALUE strscan_scan_until _((VALUE self, VALUE re));
-static VALUE strscan_skip_until _((VALUE self, VALUE re));
-static VALUE strscan_check_until _((VALUE self, VALUE re));
+static VALUE strscan_scan_until _((int argc, VALUE *argv, VALUE self));
+static VALUE strscan_skip_until _((int argc, VALUE *argv, VALUE self));
+static VALUE strscan_check_until _((int argc, VALUE *argv, VALUE self));
 static VALUE strscan_search_full _((VALUE self, VALUE re,
                                     VALUE succp, VALUE getp));
+static VALUE strscan_scan_until_any _((VALUE self, VALUE patterns));
+static VALUE strscan_matched_pattern_index _((VALUE self));
+static VALUE strscan_scan_backward _((VALUE self, VALUE re));
+static VALUE strscan_skip_backward_until _((VALUE self, VALUE re));
+static VALUE strscan_rcheck _((VALUE self, VALUE re));
+static VALUE strscan_replace _((VALUE self, VALUE range, VALUE text));
+static VALUE strscan_checkpoint _((VALUE self));
+static VALUE strscan_checkpoints _((VALUE self));
 static void adjust_registers_to_matched _((struct strscanner *p));
 static VALUE strscan_getch _((VALUE self));
 static VALUE strscan_get_byte _((VALUE self));
 static VALUE strscan_getbyte _((VALUE self));
+static VALUE strscan_scan_u8 _((VALUE self));
+static VALUE strscan_scan_u16 _((int argc, VALUE *argv, VALUE self));
+static VALUE strscan_scan_u32 _((int argc, VALUE *argv, VALUE self));
+static VALUE strscan_scan_u64 _((int argc, VALUE *argv, VALUE self));
+static VALUE strscan_scan_varint _((VALUE self));
+static VALUE strscan_scan_length_prefixed _((int argc, VALUE *argv, VALUE self));
+static VALUE strscan_scan_chars _((VALUE self, VALUE n));
+static VALUE strscan_skip_chars _((VALUE self, VALUE n));
+static VALUE strscan_scan_quoted _((int argc, VALUE *argv, VALUE self));
+static VALUE strscan_scan_fields _((int argc, VALUE *argv, VALUE self));
+static VALUE strscan_scan_ident_in _((VALUE self, VALUE table));
+static VALUE strscan_skip_trivia _((int argc, VALUE *argv, VALUE self));
+static VALUE strscan_tokenize _((VALUE self, VALUE rules, VALUE buffer));
+static VALUE strscan_regexp_cache_stats _((VALUE self));
 static VALUE strscan_peek _((VALUE self, VALUE len));
 static VALUE strscan_peep _((VALUE self, VALUE len));
+static VALUE strscan_peek_byte _((int argc, VALUE *argv, VALUE self));
+static VALUE strscan_peek_eq_p _((VALUE self, VALUE str));
+static VALUE strscan_peek_in_p _((VALUE self, VALUE charset));
 static VALUE strscan_unscan _((VALUE self));
 static VALUE strscan_bol_p _((VALUE self));
 static VALUE strscan_eos_p _((VALUE self));
@@ -124,6 +312,10 @@ static VALUE strscan_matched_p _((VALUE self));
 static VALUE strscan_matched _((VALUE self));
 static VALUE strscan_matched_size _((VALUE self));
 static VALUE strscan_aref _((VALUE self, VALUE idx));
+static VALUE strscan_captures_into _((int argc, VALUE *argv, VALUE self));
+static VALUE strscan_values_at_into _((int argc, VALUE *argv, VALUE self));
+static VALUE strscan_named_captures _((VALUE self));
+static VALUE strscan_named_captures_into _((VALUE self, VALUE st));
 static VALUE strscan_pre_match _((VALUE self));
 static VALUE strscan_post_match _((VALUE self));
 static VALUE strscan_rest _((VALUE self));
@@ -142,6 +334,9 @@ str_new(struct strscanner *p, const char *ptr, long len)
 {
     VALUE str = rb_str_new(ptr, len);
     rb_enc_copy(str, p->str);
+    if (ASCII_ONLY_P(p)) {
+        ENC_CODERANGE_SET(str, ENC_CODERANGE_7BIT);
+    }
     return str;
 }
 
@@ -167,6 +362,112 @@ extract_beg_len(struct strscanner *p, long beg_i, long len)
     return str_new(p, S_PBEG(p) + beg_i, len);
 }
 
+#define WORD_LSB 0x0101010101010101ULL
+#define WORD_MSB 0x8080808080808080ULL
+#define WORD_LOW7 0x7f7f7f7f7f7f7f7fULL
+
+/* Sets the high bit of each byte of +word+ equal to +byte+.  Unlike the
+   usual (x - LSB) & ~x & MSB trick, this has no false positives. */
+static inline uint64_t
+word_byte_mask(uint64_t word, unsigned char byte)
+{
+    uint64_t x = word ^ (WORD_LSB * byte);
+    return ~(((x & WORD_LOW7) + WORD_LOW7) | x | WORD_LOW7);
+}
+
+/* The index in memory order of the first byte marked in +mask+. */
+static inline long
+first_marked_byte(uint64_t mask)
+{
+#if defined(__GNUC__) && !defined(WORDS_BIGENDIAN)
+    return __builtin_ctzll(mask) / 8;
+#elif defined(__GNUC__)
+    return __builtin_clzll(mask) / 8;
+#else
+    unsigned char bytes[sizeof(mask)];
+    long i;
+
+    memcpy(bytes, &mask, sizeof(mask));
+    for (i = 0; bytes[i] == 0; i++);
+    return i;
+#endif
+}
+
+/*
+ * Returns a pointer to the first byte in [s, end) that is one of the
+ * +n+ (at most 3) bytes in +bytes+, or +end+ if there is none.  Looks at
+ * a word at a time.  Only use this for ASCII bytes in strings whose
+ * encoding never uses ASCII bytes inside multibyte characters; see
+ * ascii_safe_p().
+ */
+static const char *
+search_bytes(const char *s, const char *end, const unsigned char *bytes, int n)
+{
+    while (end - s >= (long)sizeof(uint64_t)) {
+        uint64_t word, mask;
+
+        memcpy(&word, s, sizeof(word));
+        mask = word_byte_mask(word, bytes[0]);
+        if (n > 1) mask |= word_byte_mask(word, bytes[1]);
+        if (n > 2) mask |= word_byte_mask(word, bytes[2]);
+        if (mask) return s + first_marked_byte(mask);
+        s += sizeof(word);
+    }
+    for (; s < end; s++) {
+        unsigned char c = *s;
+        if (c == bytes[0] || (n > 1 && c == bytes[1]) || (n > 2 && c == bytes[2])) {
+            return s;
+        }
+    }
+    return end;
+}
+
+/* Whether an ASCII byte in the scanned string is always an ASCII
+   character, i.e. never the trailing byte of a multibyte character as
+   in Shift_JIS. */
+static inline int
+ascii_safe_p(struct strscanner *p)
+{
+    rb_encoding *enc;
+
+    if (ASCII_ONLY_P(p)) return 1;
+    enc = rb_enc_get(p->str);
+    return rb_enc_to_index(enc) == rb_utf8_encindex() ||
+           rb_enc_mbmaxlen(enc) == 1;
+}
+
+/*
+ * Returns whether +s+ is at a character boundary of the scanned string.
+ */
+static int
+char_head_p(struct strscanner *p, const char *s)
+{
+    rb_encoding *enc;
+
+    if (ASCII_ONLY_P(p)) return 1;
+    enc = rb_enc_get(p->str);
+    if (rb_enc_mbmaxlen(enc) == 1) return 1;
+    return rb_enc_left_char_head(S_PBEG(p), s, S_PEND(p), enc) == s;
+}
+
+/* Same as search_bytes(), but for any ASCII-compatible encoding. */
+static const char *
+search_ascii_bytes(struct strscanner *p, const char *s, const char *end,
+                   const unsigned char *bytes, int n)
+{
+    rb_encoding *enc;
+
+    if (ascii_safe_p(p)) return search_bytes(s, end, bytes, n);
+
+    enc = rb_enc_get(p->str);
+    while (s < end) {
+        int len = rb_enc_mbclen(s, end, enc);
+        if (len == 1 && search_bytes(s, s + 1, bytes, n) == s) return s;
+        s += len;
+    }
+    return end;
+}
+
 /* =======================================================================
                                Constructor
    ======================================================================= */
@@ -177,13 +478,27 @@ strscan_mark(void *ptr)
     struct strscanner *p = ptr;
     rb_gc_mark(p->str);
     rb_gc_mark(p->regex);
+    rb_gc_mark(p->named_groups_regex);
+    rb_gc_mark(p->named_groups);
+    rb_gc_mark(p->named_groups_struct);
+    rb_gc_mark(p->named_groups_members);
+    rb_gc_mark(p->ident_key);
+    rb_gc_mark(p->timed_regexps);
 }
 
 static void
 strscan_free(void *ptr)
 {
     struct strscanner *p = ptr;
+    int i;
+
     onig_region_free(&(p->regs), 0);
+    ruby_xfree(p->checkpoints);
+    for (i = 0; i < p->n_regexp_cache; i++) {
+        ruby_xfree(p->regexp_cache[i].source);
+        onig_free(p->regexp_cache[i].re);
+    }
+    ruby_xfree(p->regexp_cache);
     ruby_xfree(p);
 }
 
@@ -192,8 +507,25 @@ strscan_memsize(const void *ptr)
 {
     const struct strscanner *p = ptr;
     size_t size = sizeof(*p) - sizeof(p->regs);
+    int i;
+
+    size += sizeof(p->checkpoints[0]) * p->checkpoints_capa;
+    if (p->regexp_cache) {
+        size += sizeof(p->regexp_cache[0]) * REGEXP_CACHE_SIZE;
+    }
+    for (i = 0; i < p->n_regexp_cache; i++) {
+        size += p->regexp_cache[i].source_len;
+#ifdef HAVE_ONIG_MEMSIZE
+        size += onig_memsize(p->regexp_cache[i].re);
+#endif
+    }
 #ifdef HAVE_ONIG_REGION_MEMSIZE
     size += onig_region_memsize(&p->regs);
+#else
+    size += sizeof(p->regs);
+    if (p->regs.allocated > 0) {
+        size += sizeof(p->regs.beg[0]) * 2 * p->regs.allocated;
+    }
 #endif
     return size;
 }
@@ -214,12 +546,92 @@ strscan_s_allocate(VALUE klass)
     onig_region_init(&(p->regs));
     p->str = Qnil;
     p->regex = Qnil;
+    p->named_groups_regex = Qnil;
+    p->named_groups = Qnil;
+    p->named_groups_struct = Qnil;
+    p->named_groups_members = Qnil;
+    p->ident_key = Qnil;
+    p->timed_regexps = Qnil;
+    p->last_checkpoint = -1;
+    p->lookbehind_window = -1;
+    p->timelimit = 0;
     return obj;
 }
 
+static void
+set_options(struct strscanner *p, VALUE options)
+{
+    p->lookbehind_window = -1;
+    p->timelimit = 0;
+    p->timed_regexps = Qnil;
+    if (!NIL_P(options)) {
+        VALUE values[3];
+        ID keyword_ids[3];
+        keyword_ids[0] = rb_intern("fixed_anchor");
+        keyword_ids[1] = rb_intern("lookbehind_window");
+        keyword_ids[2] = rb_intern("timeout");
+        rb_get_kwargs(options, keyword_ids, 0, 3, values);
+        if (values[0] == Qundef) {
+            p->fixed_anchor_p = false;
+        }
+        else {
+            p->fixed_anchor_p = RTEST(values[0]);
+        }
+        if (values[1] != Qundef && !NIL_P(values[1])) {
+            long window = NUM2LONG(values[1]);
+            if (!p->fixed_anchor_p) {
+                rb_raise(rb_eArgError, "lookbehind_window requires fixed_anchor: true");
+            }
+            if (window < 0) {
+                rb_raise(rb_eArgError, "negative lookbehind_window: %ld", window);
+            }
+            p->lookbehind_window = window;
+        }
+        if (values[2] != Qundef && !NIL_P(values[2])) {
+            double timeout = NUM2DBL(values[2]);
+#ifndef HAVE_STRUCT_RE_PATTERN_BUFFER_TIMELIMIT
+            rb_raise(rb_eNotImpError, "timeout is not supported by this Ruby");
+#endif
+            if (!(timeout > 0)) {
+                rb_raise(rb_eArgError, "invalid timeout: %"PRIsVALUE, values[2]);
+            }
+            /* as Regexp.timeout=, too long is as long as it can be */
+            if (timeout >= (double)UINT64_MAX / 1e9) {
+                p->timelimit = UINT64_MAX;
+            }
+            else {
+                p->timelimit = (uint64_t)(timeout * 1e9);
+                if (p->timelimit == 0) p->timelimit = 1;
+            }
+        }
+    }
+    else {
+        p->fixed_anchor_p = false;
+    }
+}
+
+static void
+set_string(struct strscanner *p, VALUE str)
+{
+    if (!NIL_P(str)) {
+        rb_enc_str_coderange(str);
+    }
+    p->str = str;
+    p->str_generation++;
+    /* the match is gone, so its regexp needn't be kept alive */
+    p->regex = Qnil;
+    p->curr = 0;
+    p->window_head = 0;
+    p->n_checkpoints = 0;
+    p->last_checkpoint = -1;
+    CLEAR_LIMITED(p);
+    CLEAR_MATCH_STATUS(p);
+    cache_string(p);
+}
+
 /*
  * call-seq:
- *    StringScanner.new(string, fixed_anchor: false)
+ *    StringScanner.new(string, fixed_anchor: false, lookbehind_window: nil, timeout: nil)
  *    StringScanner.new(string, dup = false)
  *
  * Creates a new StringScanner object to scan over the given +string+.
@@ -227,6 +639,18 @@ strscan_s_allocate(VALUE klass)
  * If +fixed_anchor+ is +true+, +\A+ always matches the beginning of
  * the string. Otherwise, +\A+ always matches the current position.
  *
+ * In fixed anchor mode, regexps see the whole string before the scan
+ * pointer, which can be slow for lookbehinds on long strings in some
+ * encodings.  +lookbehind_window+ limits them to that many bytes
+ * (rounded back to a character boundary) before the scan pointer.
+ * +\A+ and +^+ keep matching as if the whole string were there.
+ *
+ * +timeout+ limits each regexp match to that many seconds, overriding
+ * Regexp.timeout and the regexp's own timeout.  A match that takes
+ * longer raises StringScanner::MatchLimitError.  The scanner matches
+ * with copies of its regexps that have this timeout, so the regexps
+ * themselves are left alone.
+ *
  * +dup+ argument is obsolete and not used now.
  */
 static VALUE
@@ -237,24 +661,38 @@ strscan_initialize(int argc, VALUE *argv, VALUE self)
 
     p = check_strscan(self);
     rb_scan_args(argc, argv, "11", &str, &options);
-    options = rb_check_hash_type(options);
-    if (!NIL_P(options)) {
-        VALUE fixed_anchor;
-        ID keyword_ids[1];
-        keyword_ids[0] = rb_intern("fixed_anchor");
-        rb_get_kwargs(options, keyword_ids, 0, 1, &fixed_anchor);
-        if (fixed_anchor == Qundef) {
-            p->fixed_anchor_p = false;
-        }
-        else {
-            p->fixed_anchor_p = RTEST(fixed_anchor);
-        }
-    }
-    else {
-        p->fixed_anchor_p = false;
-    }
+    set_options(p, rb_check_hash_type(options));
     StringValue(str);
-    p->str = str;
+    set_string(p, str);
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *    reset_with(string, fixed_anchor: false, lookbehind_window: nil, timeout: nil)
+ *
+ * Reinitializes the scanner as StringScanner.new(string, **options)
+ * would, but reuses this object and its match register storage.
+ * Returns the scanner.  Keeping a scanner, say one per thread, and
+ * resetting it for each string allocates no scanner per string.
+ *
+ *   s = StringScanner.new('test string')
+ *   s.scan(/\w+/)             # -> "test"
+ *   s.reset_with('other')
+ *   s.scan(/\w+/)             # -> "other"
+ */
+static VALUE
+strscan_reset_with(int argc, VALUE *argv, VALUE self)
+{
+    struct strscanner *p;
+    VALUE str, options;
+
+    p = check_strscan(self);
+    rb_scan_args(argc, argv, "1:", &str, &options);
+    set_options(p, options);
+    StringValue(str);
+    set_string(p, str);
 
     return self;
 }
@@ -284,6 +722,22 @@ strscan_init_copy(VALUE vself, VALUE vorig)
 	self->str = orig->str;
 	self->prev = orig->prev;
 	self->curr = orig->curr;
+	self->limit = orig->limit;
+	self->str_ptr = orig->str_ptr;
+	self->str_len = orig->str_len;
+	self->beg0 = orig->beg0;
+	self->end0 = orig->end0;
+	self->pattern_index = orig->pattern_index;
+	self->lookbehind_window = orig->lookbehind_window;
+	self->window_head = orig->window_head;
+	self->timelimit = orig->timelimit;
+	if (orig->n_checkpoints > self->checkpoints_capa) {
+	    REALLOC_N(self->checkpoints, long, orig->n_checkpoints);
+	    self->checkpoints_capa = orig->n_checkpoints;
+	}
+	MEMCPY(self->checkpoints, orig->checkpoints, long, orig->n_checkpoints);
+	self->n_checkpoints = orig->n_checkpoints;
+	self->last_checkpoint = orig->last_checkpoint;
 	if (rb_reg_region_copy(&self->regs, &orig->regs))
 	    rb_memerror();
 	RB_GC_GUARD(vorig);
@@ -374,9 +828,7 @@ strscan_set_string(VALUE self, VALUE str)
     struct strscanner *p = check_strscan(self);
 
     StringValue(str);
-    p->str = str;
-    p->curr = 0;
-    CLEAR_MATCH_STATUS(p);
+    set_string(p, str);
     return str;
 }
 
@@ -401,6 +853,8 @@ strscan_concat(VALUE self, VALUE str)
 
     GET_SCANNER(self, p);
     StringValue(str);
+    /* rb_str_append() keeps the coderange of p->str when both are known */
+    rb_enc_str_coderange(str);
     rb_str_append(p->str, str);
     return self;
 }
@@ -449,6 +903,9 @@ strscan_get_charpos(VALUE self)
 
     GET_SCANNER(self, p);
 
+    if (ASCII_ONLY_P(p)) {
+        return LONG2NUM(minl(p->curr, S_LEN(p)));
+    }
     substr = rb_funcall(p->str, id_byteslice, 2, INT2FIX(0), LONG2NUM(p->curr));
 
     return rb_str_length(substr);
@@ -478,136 +935,833 @@ strscan_set_pos(VALUE self, VALUE v)
     return LONG2NUM(i);
 }
 
-static inline UChar *
-match_target(struct strscanner *p)
+static void
+set_limit(struct strscanner *p, VALUE v)
 {
-    if (p->fixed_anchor_p) {
-        return (UChar *)S_PBEG(p);
+    long i;
+
+    if (NIL_P(v)) {
+        CLEAR_LIMITED(p);
+        cache_string(p);
+        return;
     }
-    else
-    {
-        return (UChar *)CURPTR(p);
+    i = NUM2LONG(v);
+    if (i < p->curr || i > RSTRING_LEN(p->str)) {
+        rb_raise(rb_eRangeError, "limit out of range");
     }
+    p->limit = i;
+    LIMITED(p);
+    cache_string(p);
 }
 
-static inline void
-set_registers(struct strscanner *p, size_t length)
+/*
+ * Returns the byte position treated as the end of the string, or +nil+
+ * if the whole string is scanned.  See #limit=.
+ */
+static VALUE
+strscan_get_limit(VALUE self)
 {
-    const int at = 0;
-    OnigRegion *regs = &(p->regs);
-    onig_region_clear(regs);
-    if (onig_region_set(regs, at, 0, 0)) return;
-    if (p->fixed_anchor_p) {
-        regs->beg[at] = p->curr;
-        regs->end[at] = p->curr + length;
-    }
-    else
-    {
-        regs->end[at] = length;
-    }
+    struct strscanner *p;
+
+    GET_SCANNER(self, p);
+    if (! LIMITED_P(p)) return Qnil;
+    return LONG2NUM(p->limit);
 }
 
-static inline void
-succ(struct strscanner *p)
+/*
+ * call-seq: limit=(end_pos)
+ *
+ * Makes the scanner treat the byte position +end_pos+ as the end of the
+ * string without copying it.  Matches, searches, #eos?, #rest and
+ * #post_match stop at +end_pos+.  Set it to +nil+ to scan the whole
+ * string again.  +end_pos+ must lie between the scan pointer and the
+ * end of the string.  Changing the string with #string= removes it.
+ *
+ *   s = StringScanner.new("a,b\nc,d\n")
+ *   s.limit = 4
+ *   s.scan_until(/d/)   # -> nil
+ *   s.rest              # -> "a,b\n"
+ *   s.limit = nil
+ *   s.scan_until(/d/)   # -> "a,b\nc,d"
+ */
+static VALUE
+strscan_set_limit(VALUE self, VALUE v)
 {
-    if (p->fixed_anchor_p) {
-        p->curr = p->regs.end[0];
-    }
-    else
-    {
-        p->curr += p->regs.end[0];
-    }
+    struct strscanner *p;
+
+    GET_SCANNER(self, p);
+    set_limit(p, v);
+    return v;
 }
 
-static inline long
-last_match_length(struct strscanner *p)
+struct limit_state {
+    VALUE self;
+    unsigned long limited;
+    long limit;
+    unsigned long str_generation;
+};
+
+static VALUE
+strscan_restore_limit(VALUE arg)
 {
-    if (p->fixed_anchor_p) {
-        return p->regs.end[0] - p->prev;
-    }
-    else
-    {
-        return p->regs.end[0];
+    struct limit_state *state = (struct limit_state *)arg;
+    struct strscanner *p = check_strscan(state->self);
+
+    /* The old limit was for a string the block replaced or edited. */
+    if (p->str_generation != state->str_generation) return Qnil;
+
+    p->flags = (p->flags & ~FLAG_LIMITED) | state->limited;
+    p->limit = state->limit;
+    /* the block may have scanned past it under a wider limit */
+    if (LIMITED_P(p) && p->limit < p->curr) p->limit = p->curr;
+    cache_string(p);
+    return Qnil;
+}
+
+/*
+ * call-seq: with_limit(end_pos) { |scanner| ... }
+ *
+ * Sets #limit to +end_pos+ while the block runs and restores the
+ * previous limit afterwards, unless the block changed the string with
+ * #string=, #reset_with or #replace.  Returns the value of the block.
+ *
+ *   s = StringScanner.new("key=value; rest")
+ *   s.with_limit(9) { s.scan(/\w+=/); s.rest }   # -> "value"
+ *   s.rest                                      # -> "value; rest"
+ */
+static VALUE
+strscan_with_limit(VALUE self, VALUE v)
+{
+    struct strscanner *p;
+    struct limit_state state;
+
+    GET_SCANNER(self, p);
+    state.self = self;
+    state.limited = LIMITED_P(p);
+    state.limit = p->limit;
+    state.str_generation = p->str_generation;
+    set_limit(p, v);
+    return rb_ensure(rb_yield, self, strscan_restore_limit, (VALUE)&state);
+}
+
+/* A Regexp compiled for the encoding of the scanned string. */
+struct scan_regexp {
+    VALUE pattern;
+    regex_t *re;
+    /* whether re is owned by the scanner's regexp cache */
+    int cached;
+};
+
+static void
+regexp_cache_key(struct strscanner *p, VALUE pattern,
+                 struct regexp_cache_entry *key)
+{
+    key->source = (char *)RREGEXP_SRC_PTR(pattern);
+    key->source_len = RREGEXP_SRC_LEN(pattern);
+    key->options = rb_reg_options(pattern);
+    key->pattern_encindex = ENCODING_GET(pattern);
+    key->str_encindex = ENCODING_GET(p->str);
+    key->str_coderange = rb_enc_str_coderange(p->str);
+}
+
+static int
+regexp_cache_key_eq(const struct regexp_cache_entry *a,
+                    const struct regexp_cache_entry *b)
+{
+    return a->source_len == b->source_len &&
+           a->options == b->options &&
+           a->pattern_encindex == b->pattern_encindex &&
+           a->str_encindex == b->str_encindex &&
+           a->str_coderange == b->str_coderange &&
+           memcmp(a->source, b->source, a->source_len) == 0;
+}
+
+static regex_t *
+regexp_cache_lookup(struct strscanner *p, VALUE pattern)
+{
+    struct regexp_cache_entry key;
+    int i;
+
+    regexp_cache_key(p, pattern, &key);
+    for (i = 0; i < p->n_regexp_cache; i++) {
+        struct regexp_cache_entry *entry = &p->regexp_cache[i];
+        if (regexp_cache_key_eq(entry, &key)) {
+            entry->used = ++p->regexp_cache_clock;
+            p->regexp_cache_hits++;
+            return entry->re;
+        }
     }
+    return NULL;
 }
 
-static inline long
-adjust_register_position(struct strscanner *p, long position)
+/* Takes +re+, compiled for the scanned string, into the regexp cache. */
+static void
+regexp_cache_insert(struct strscanner *p, VALUE pattern, regex_t *re)
 {
-    if (p->fixed_anchor_p) {
-        return position;
+    struct regexp_cache_entry *entry;
+    int i;
+
+    if (!p->regexp_cache) {
+        p->regexp_cache = ZALLOC_N(struct regexp_cache_entry, REGEXP_CACHE_SIZE);
+    }
+    if (p->n_regexp_cache < REGEXP_CACHE_SIZE) {
+        entry = &p->regexp_cache[p->n_regexp_cache++];
     }
     else {
-        return p->prev + position;
+        entry = &p->regexp_cache[0];
+        for (i = 1; i < p->n_regexp_cache; i++) {
+            if (p->regexp_cache[i].used < entry->used) {
+                entry = &p->regexp_cache[i];
+            }
+        }
+        ruby_xfree(entry->source);
+        onig_free(entry->re);
     }
+    regexp_cache_key(p, pattern, entry);
+    entry->source = ALLOC_N(char, entry->source_len);
+    memcpy(entry->source, RREGEXP_SRC_PTR(pattern), entry->source_len);
+    entry->re = re;
+    entry->used = ++p->regexp_cache_clock;
+    p->regexp_cache_misses++;
 }
 
+#ifdef HAVE_STRUCT_RE_PATTERN_BUFFER_TIMELIMIT
+/*
+ * Returns a copy of +pattern+ with the scanner's timeout.  The timeout
+ * lives in the regex_t shared by everything matching with +pattern+, and
+ * a match may switch threads, so the scanner matches with its own copies
+ * rather than setting it for a match.
+ */
 static VALUE
-strscan_do_scan(VALUE self, VALUE pattern, int succptr, int getstr, int headonly)
+timed_regexp(struct strscanner *p, VALUE pattern)
 {
-    struct strscanner *p;
+    VALUE copy, args[2];
 
-    if (headonly) {
-        if (!RB_TYPE_P(pattern, T_REGEXP)) {
-            StringValue(pattern);
-        }
-    }
-    else {
-        Check_Type(pattern, T_REGEXP);
+    if (NIL_P(p->timed_regexps)) {
+        p->timed_regexps = rb_hash_new();
     }
-    GET_SCANNER(self, p);
+    copy = rb_hash_lookup2(p->timed_regexps, pattern, Qundef);
+    if (copy != Qundef) return copy;
 
-    CLEAR_MATCH_STATUS(p);
-    if (S_RESTLEN(p) < 0) {
-        return Qnil;
+    if (RHASH_SIZE(p->timed_regexps) >= REGEXP_CACHE_SIZE) {
+        rb_hash_clear(p->timed_regexps);
     }
+    args[0] = pattern;
+    args[1] = rb_hash_new();
+    rb_hash_aset(args[1], ID2SYM(rb_intern("timeout")),
+                 DBL2NUM(p->timelimit / 1e9));
+    copy = rb_funcallv_kw(rb_cRegexp, rb_intern("new"), 2, args,
+                          RB_PASS_KEYWORDS);
+    rb_hash_aset(p->timed_regexps, pattern, copy);
+    return copy;
+}
+#endif
 
-    if (RB_TYPE_P(pattern, T_REGEXP)) {
-        regex_t *rb_reg_prepare_re(VALUE re, VALUE str);
-        regex_t *re;
-        long ret;
-        int tmpreg;
+struct prepare_re_args {
+    VALUE pattern;
+    VALUE str;
+    regex_t *re;
+};
 
-        p->regex = pattern;
-        re = rb_reg_prepare_re(pattern, p->str);
-        tmpreg = re != RREGEXP_PTR(pattern);
-        if (!tmpreg) RREGEXP(pattern)->usecnt++;
+static VALUE
+prepare_re_i(VALUE arg)
+{
+    regex_t *rb_reg_prepare_re(VALUE re, VALUE str);
+    struct prepare_re_args *args = (struct prepare_re_args *)arg;
 
-        if (headonly) {
-            ret = onig_match(re,
-                             match_target(p),
-                             (UChar* )(CURPTR(p) + S_RESTLEN(p)),
-                             (UChar* )CURPTR(p),
-                             &(p->regs),
-                             ONIG_OPTION_NONE);
-        }
-        else {
-            ret = onig_search(re,
-                              match_target(p),
-                              (UChar* )(CURPTR(p) + S_RESTLEN(p)),
-                              (UChar* )CURPTR(p),
-                              (UChar* )(CURPTR(p) + S_RESTLEN(p)),
-                              &(p->regs),
-                              ONIG_OPTION_NONE);
+    args->re = rb_reg_prepare_re(args->pattern, args->str);
+    return Qnil;
+}
+
+static VALUE
+release_usecnt_i(VALUE pattern)
+{
+    RREGEXP(pattern)->usecnt--;
+    return Qnil;
+}
+
+/*
+ * Prepares +pattern+ for matching with regexp_exec().  Pass +sr+ to
+ * release_regexp() once the match is done.
+ *
+ * A Regexp whose encoding doesn't suit the scanned string is compiled
+ * again for it, on every match, so the scanner keeps its own copies.
+ */
+static void
+prepare_regexp(struct strscanner *p, VALUE pattern, struct scan_regexp *sr)
+{
+    regex_t *rb_reg_prepare_re(VALUE re, VALUE str);
+    rb_encoding *reg_enc;
+
+#ifdef HAVE_STRUCT_RE_PATTERN_BUFFER_TIMELIMIT
+    if (p->timelimit) pattern = timed_regexp(p, pattern);
+#endif
+    reg_enc = RREGEXP_PTR(pattern)->enc;
+    sr->pattern = pattern;
+    if (reg_enc == rb_enc_get(p->str) ||
+        (reg_enc == rb_usascii_encoding() && ASCII_ONLY_P(p))) {
+        /* the usual cases, which never compile */
+        sr->re = rb_reg_prepare_re(pattern, p->str);
+    }
+    else if (!(sr->re = regexp_cache_lookup(p, pattern))) {
+        struct prepare_re_args args;
+
+        /* On Ruby 3.3, rb_reg_prepare_re() puts the regex_t it compiles
+           into the Regexp unless the Regexp is in use, and one Regexp
+           scanned in two encodings is compiled back and forth.  Marking
+           it in use keeps the compiled one ours to cache. */
+        args.pattern = pattern;
+        args.str = p->str;
+        RREGEXP(pattern)->usecnt++;
+        rb_ensure(prepare_re_i, (VALUE)&args, release_usecnt_i, pattern);
+        sr->re = args.re;
+        if (sr->re != RREGEXP_PTR(pattern)) {
+            regexp_cache_insert(p, pattern, sr->re);
+        }
+    }
+    sr->cached = sr->re != RREGEXP_PTR(pattern);
+    if (!sr->cached) RREGEXP(pattern)->usecnt++;
+}
+
+static void
+release_regexp(struct scan_regexp *sr)
+{
+    if (!sr->cached) RREGEXP(sr->pattern)->usecnt--;
+}
+
+struct regexp_exec_args {
+    regex_t *re;
+    UChar *str, *end, *start, *range;
+    OnigRegion *region;
+    OnigOptionType options;
+    long result;
+};
+
+static VALUE
+regexp_exec_i(VALUE arg)
+{
+    struct regexp_exec_args *args = (struct regexp_exec_args *)arg;
+
+    if (args->range) {
+        args->result = onig_search(args->re, args->str, args->end,
+                                   args->start, args->range,
+                                   args->region, args->options);
+    }
+    else {
+        args->result = onig_match(args->re, args->str, args->end,
+                                  args->start, args->region, args->options);
+    }
+    return Qnil;
+}
+
+/*
+ * Runs onig_search() from +start+ to +range+, or onig_match() at +start+
+ * if +range+ is NULL, and returns its result.  A match timing out under
+ * the scanner's own timeout raises MatchLimitError, one running out of
+ * memory NoMemoryError, and one overflowing its buffer ScanError; +sr+ is
+ * released before raising.
+ */
+static long
+regexp_exec(struct strscanner *p, struct scan_regexp *sr,
+            UChar *str, UChar *end, UChar *start, UChar *range,
+            OnigRegion *region, OnigOptionType options)
+{
+    struct regexp_exec_args args;
+
+    args.re = sr->re;
+    args.str = str;
+    args.end = end;
+    args.start = start;
+    args.range = range;
+    args.region = region;
+    args.options = options;
+    if (!p->timelimit) {
+        regexp_exec_i((VALUE)&args);
+    }
+    else {
+        int state;
+
+        rb_protect(regexp_exec_i, (VALUE)&args, &state);
+        if (state) {
+            VALUE error = rb_errinfo();
+
+            release_regexp(sr);
+            if (!NIL_P(RegexpTimeoutError) &&
+                rb_obj_is_kind_of(error, RegexpTimeoutError)) {
+                rb_set_errinfo(Qnil);
+                rb_raise(MatchLimitError, "regexp match timed out");
+            }
+            rb_jump_tag(state);
+        }
+    }
+
+    switch (args.result) {
+      case ONIGERR_MEMORY:
+        release_regexp(sr);
+        rb_memerror();
+      case -2:
+        release_regexp(sr);
+        rb_raise(ScanError, "regexp buffer overflow");
+    }
+    return args.result;
+}
+
+/*
+ * Returns the last character boundary at or before +limit+.  Finding it
+ * backward is O(n) in encodings such as EUC-JP, so it's found by walking
+ * forward from the one returned last time, which is amortized O(1) while
+ * the scan pointer moves forward.
+ */
+static long
+window_head(struct strscanner *p, long limit)
+{
+    rb_encoding *enc = rb_enc_get(p->str);
+    const char *beg = S_PBEG(p), *end = S_PEND(p);
+    long head;
+
+    if (rb_enc_mbmaxlen(enc) == 1) return limit;
+    if (rb_enc_to_index(enc) == rb_utf8_encindex()) {
+        return rb_enc_left_char_head(beg, beg + limit, end, enc) - beg;
+    }
+
+    head = p->window_head <= limit ? p->window_head : 0;
+    while (head < limit) {
+        int len = rb_enc_mbclen(beg + head, end, enc);
+        if (head + len > limit) break;
+        head += len;
+    }
+    p->window_head = head;
+    return head;
+}
+
+/* Where match_target() begins, as a byte offset into the string. */
+static inline long
+match_target_offset(struct strscanner *p)
+{
+    if (!p->fixed_anchor_p) return p->curr;
+    if (p->lookbehind_window < 0 || p->curr <= p->lookbehind_window) return 0;
+    if (ASCII_ONLY_P(p)) return p->curr - p->lookbehind_window;
+    return window_head(p, p->curr - p->lookbehind_window);
+}
+
+static inline UChar *
+match_target(struct strscanner *p)
+{
+    return (UChar *)S_PBEG(p) + match_target_offset(p);
+}
+
+/*
+ * The Onigmo options for matching against the string from
+ * +target_offset+, which keep \A and ^ from matching there unless they
+ * would at that position of the whole string.
+ */
+static inline OnigOptionType
+match_options(struct strscanner *p, long target_offset)
+{
+    OnigOptionType options = ONIG_OPTION_NONE;
+
+    if (!p->fixed_anchor_p || target_offset == 0) return options;
+#ifdef ONIG_OPTION_NOTBOS
+    options |= ONIG_OPTION_NOTBOS;
+#endif
+    if (S_PBEG(p)[target_offset - 1] != '\n') options |= ONIG_OPTION_NOTBOL;
+    return options;
+}
+
+/*
+ * Makes the registers of a regexp match against the string from
+ * +target_offset+ absolute again, as fixed anchor mode expects.
+ */
+static void
+shift_registers(struct strscanner *p, long target_offset)
+{
+    int i;
+
+    for (i = 0; i < p->regs.num_regs; i++) {
+        if (p->regs.beg[i] == -1) continue;
+        p->regs.beg[i] += target_offset;
+        p->regs.end[i] += target_offset;
+    }
+}
+
+static inline void
+set_registers(struct strscanner *p, size_t length)
+{
+    INLINE_REGS(p);
+    if (p->fixed_anchor_p) {
+        p->beg0 = p->curr;
+        p->end0 = p->curr + length;
+    }
+    else
+    {
+        p->beg0 = 0;
+        p->end0 = length;
+    }
+}
+
+static inline void
+succ(struct strscanner *p)
+{
+    if (p->fixed_anchor_p) {
+        p->curr = REG_END(p, 0);
+    }
+    else
+    {
+        p->curr += REG_END(p, 0);
+    }
+}
+
+static inline long
+last_match_length(struct strscanner *p)
+{
+    if (p->fixed_anchor_p) {
+        return REG_END(p, 0) - p->prev;
+    }
+    else
+    {
+        return REG_END(p, 0);
+    }
+}
+
+static inline long
+adjust_register_position(struct strscanner *p, long position)
+{
+    if (p->fixed_anchor_p || ABSOLUTE_REGS_P(p)) {
+        return position;
+    }
+    else {
+        return p->prev + position;
+    }
+}
+
+/* A String pattern of #scan and friends. */
+struct literal {
+    const char *ptr;
+    long len;
+    int ignore_case;
+    /* ignore_case of an ASCII-only literal in an ASCII-compatible
+       encoding, which needs only ASCII case folding against ASCII text */
+    int ascii;
+    /* the case folded literal, made on first use; see folded_match_at() */
+    UChar *folded;
+    long folded_len;
+    UChar folded_buf[256];
+};
+
+static void
+literal_init(struct strscanner *p, struct literal *lit, VALUE pattern,
+             int ignore_case)
+{
+    lit->ptr = RSTRING_PTR(pattern);
+    lit->len = RSTRING_LEN(pattern);
+    lit->ignore_case = ignore_case;
+    lit->ascii = ignore_case && rb_enc_asciicompat(rb_enc_get(p->str)) &&
+                 rb_enc_str_asciionly_p(pattern);
+    lit->folded = NULL;
+}
+
+static void
+literal_free(struct literal *lit)
+{
+    if (lit->folded && lit->folded != lit->folded_buf) xfree(lit->folded);
+}
+
+/* Lowercases the ASCII letters in +word+. */
+static inline uint64_t
+word_ascii_downcase(uint64_t word)
+{
+    uint64_t heptets = word & WORD_LOW7;
+    uint64_t ge_A = heptets + WORD_LSB * (0x80 - 'A');
+    uint64_t gt_Z = heptets + WORD_LSB * (0x80 - 'Z' - 1);
+    uint64_t upper = ge_A & ~gt_Z & ~word & WORD_MSB;
+    return word | (upper >> 2);
+}
+
+/*
+ * Compares +len+ bytes at +s+ with the ASCII-only +lit+ ignoring ASCII
+ * case, a word at a time.  Returns 1 if they're equal, 0 if not, or -1 if
+ * +s+ has a non-ASCII byte, which may still fold to ASCII letters.
+ */
+static int
+ascii_casecmp(const char *s, const char *lit, long len)
+{
+    long i = 0;
+
+    for (; i + (long)sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        uint64_t a, b;
+        memcpy(&a, s + i, sizeof(a));
+        memcpy(&b, lit + i, sizeof(b));
+        if (a & WORD_MSB) return -1;
+        if (word_ascii_downcase(a) != word_ascii_downcase(b)) return 0;
+    }
+    for (; i < len; i++) {
+        unsigned char c = s[i];
+        if (c >= 0x80) return -1;
+        if (rb_tolower(c) != rb_tolower((unsigned char)lit[i])) return 0;
+    }
+    return 1;
+}
+
+/*
+ * Returns the length of the text at +s+ that matches +lit+ with both case
+ * folded as Onigmo folds them for //i, or -1.
+ */
+static long
+folded_match_at(struct strscanner *p, struct literal *lit,
+                const char *s, const char *end)
+{
+    rb_encoding *enc = rb_enc_get(p->str);
+    const UChar *q;
+    long i;
+
+    if (!lit->folded) {
+        const UChar *lit_end = (const UChar *)lit->ptr + lit->len;
+        long capa = lit->len * ONIGENC_MBC_CASE_FOLD_MAXLEN;
+        lit->folded = capa <= (long)sizeof(lit->folded_buf) ?
+            lit->folded_buf : ALLOC_N(UChar, capa);
+        lit->folded_len = 0;
+        q = (const UChar *)lit->ptr;
+        while (q < lit_end) {
+            lit->folded_len += ONIGENC_MBC_CASE_FOLD(enc, ONIGENC_CASE_FOLD_MIN,
+                                                     &q, lit_end,
+                                                     lit->folded + lit->folded_len);
+        }
+    }
+
+    q = (const UChar *)s;
+    for (i = 0; i < lit->folded_len;) {
+        UChar buf[ONIGENC_MBC_CASE_FOLD_MAXLEN];
+        int n;
+
+        if (q >= (const UChar *)end) return -1;
+        n = ONIGENC_MBC_CASE_FOLD(enc, ONIGENC_CASE_FOLD_MIN, &q,
+                                  (const UChar *)end, buf);
+        if (n > lit->folded_len - i || memcmp(buf, lit->folded + i, n) != 0) {
+            return -1;
+        }
+        i += n;
+    }
+    return (const char *)q - s;
+}
+
+/* Returns the length of the text at +s+ that matches +lit+, or -1. */
+static long
+literal_match_at(struct strscanner *p, struct literal *lit,
+                 const char *s, const char *end)
+{
+    if (!lit->ignore_case) {
+        if (end - s < lit->len || memcmp(s, lit->ptr, lit->len) != 0) return -1;
+        return lit->len;
+    }
+    if (lit->ascii) {
+        if (end - s >= lit->len) {
+            int ret = ascii_casecmp(s, lit->ptr, lit->len);
+            if (ret >= 0) return ret ? lit->len : -1;
         }
-        if (!tmpreg) RREGEXP(pattern)->usecnt--;
-        if (tmpreg) {
-            if (RREGEXP(pattern)->usecnt) {
-                onig_free(re);
+        else if (ASCII_ONLY_P(p)) {
+            return -1;
+        }
+    }
+    return folded_match_at(p, lit, s, end);
+}
+
+/*
+ * Returns the offset from the scan pointer of the first match of +lit+,
+ * storing the length of the matched text in *length, or -1.
+ */
+static long
+literal_search(struct strscanner *p, struct literal *lit, long *length)
+{
+    const char *beg = CURPTR(p), *end = S_PEND(p), *s;
+    rb_encoding *enc = rb_enc_get(p->str);
+    unsigned char bytes[2];
+    int n_bytes = 0;
+    long len;
+
+    if (lit->len == 0) {
+        *length = 0;
+        return 0;
+    }
+
+    /* The first byte of a match is known unless case folding may turn
+       non-ASCII text into it. */
+    if (!lit->ignore_case) {
+        bytes[n_bytes++] = lit->ptr[0];
+    }
+    else if (lit->ascii && ASCII_ONLY_P(p)) {
+        bytes[n_bytes++] = rb_tolower((unsigned char)lit->ptr[0]);
+        if (rb_toupper(bytes[0]) != bytes[0]) bytes[n_bytes++] = rb_toupper(bytes[0]);
+    }
+    if (n_bytes > 0) {
+        int ascii = bytes[0] < 0x80 && rb_enc_asciicompat(enc);
+        for (s = beg; end - s >= lit->len; s++) {
+            if (ascii) {
+                s = search_ascii_bytes(p, s, end, bytes, n_bytes);
             }
             else {
-                onig_free(RREGEXP_PTR(pattern));
-                RREGEXP_PTR(pattern) = re;
+                s = memchr(s, bytes[0], end - s);
+                if (!s) break;
+            }
+            if (end - s < lit->len) break;
+            /* most candidates are rejected by their last byte */
+            if (lit->ignore_case ?
+                rb_tolower((unsigned char)s[lit->len - 1]) !=
+                rb_tolower((unsigned char)lit->ptr[lit->len - 1]) :
+                s[lit->len - 1] != lit->ptr[lit->len - 1]) {
+                continue;
             }
+            if (!char_head_p(p, s)) continue;
+            len = literal_match_at(p, lit, s, end);
+            if (len >= 0) {
+                *length = len;
+                return s - beg;
+            }
+        }
+        return -1;
+    }
+
+    for (s = beg; s < end; s += minl(rb_enc_mbclen(s, end, enc), end - s)) {
+        len = literal_match_at(p, lit, s, end);
+        if (len >= 0) {
+            *length = len;
+            return s - beg;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Matches the String +pattern+ at the scan pointer, or searches for it
+ * unless +headonly+.  Returns the offset of the match from the scan
+ * pointer, storing its length in *length, or -1.  It's kept out of line
+ * so that struct literal, folded buffer and all, stays off the stack of
+ * the inlined strscan_do_scan.
+ */
+NOINLINE(static long scan_literal(struct strscanner *p, VALUE pattern,
+                                  int headonly, int ignore_case, long *length));
+static long
+scan_literal(struct strscanner *p, VALUE pattern, int headonly,
+             int ignore_case, long *length)
+{
+    struct literal lit;
+    long offset;
+
+    literal_init(p, &lit, pattern, ignore_case);
+    if (headonly) {
+        offset = 0;
+        *length = literal_match_at(p, &lit, CURPTR(p), S_PEND(p));
+    }
+    else {
+        offset = literal_search(p, &lit, length);
+    }
+    literal_free(&lit);
+    if (*length < 0) return -1;
+    return offset;
+}
+
+/*
+ * Parses the arguments of #scan and friends, (pattern, ignore_case:
+ * false), into *pattern and returns ignore_case.
+ */
+static int
+scan_args(int argc, VALUE *argv, VALUE *pattern)
+{
+    VALUE options, value;
+    ID keyword_id;
+
+    if (argc == 1) {
+        *pattern = argv[0];
+        return 0;
+    }
+    keyword_id = rb_intern("ignore_case");
+    value = Qundef;
+#ifdef HAVE_RB_KEYWORD_GIVEN_P
+    if (argc == 2 && rb_keyword_given_p() && RB_TYPE_P(argv[1], T_HASH) &&
+        RHASH_SIZE(argv[1]) == 1) {
+        /* the usual call, without the generic parsing */
+        *pattern = argv[0];
+        value = rb_hash_lookup2(argv[1], ID2SYM(keyword_id), Qundef);
+    }
+#endif
+    if (value == Qundef) {
+        rb_scan_args(argc, argv, "1:", pattern, &options);
+        if (NIL_P(options)) return 0;
+        rb_get_kwargs(options, &keyword_id, 0, 1, &value);
+    }
+    if (value == Qundef || !RTEST(value)) return 0;
+    if (RB_TYPE_P(*pattern, T_REGEXP)) {
+        rb_raise(rb_eArgError, "ignore_case is only for String patterns; use //i");
+    }
+    return 1;
+}
+
+/*
+ * The body of #scan, #skip, #match?, #check and the *_until methods.  It's
+ * always inlined, so each of them gets its own copy with +succptr+,
+ * +getstr+ and +headonly+ folded away; only #scan_full and #search_full
+ * still branch on them at runtime.
+ */
+static inline VALUE
+strscan_do_scan(VALUE self, VALUE pattern, int succptr, int getstr, int headonly,
+                int ignore_case)
+{
+    struct strscanner *p;
+
+    if (!RB_TYPE_P(pattern, T_REGEXP)) {
+        StringValue(pattern);
+    }
+    GET_SCANNER(self, p);
+
+    CLEAR_MATCH_STATUS(p);
+    if (S_RESTLEN(p) < 0) {
+        return Qnil;
+    }
+
+    if (RB_TYPE_P(pattern, T_REGEXP)) {
+        struct scan_regexp sr;
+        long ret, target_offset;
+        int inline_regs;
+
+        p->regex = pattern;
+        prepare_regexp(p, pattern, &sr);
+        target_offset = match_target_offset(p);
+
+        inline_regs = headonly && onig_number_of_captures(sr.re) == 0;
+        if (headonly) {
+            ret = regexp_exec(p, &sr,
+                              (UChar* )S_PBEG(p) + target_offset,
+                              (UChar* )(CURPTR(p) + S_RESTLEN(p)),
+                              (UChar* )CURPTR(p),
+                              NULL,
+                              inline_regs ? NULL : &(p->regs),
+                              match_options(p, target_offset));
+        }
+        else {
+            ret = regexp_exec(p, &sr,
+                              (UChar* )S_PBEG(p) + target_offset,
+                              (UChar* )(CURPTR(p) + S_RESTLEN(p)),
+                              (UChar* )CURPTR(p),
+                              (UChar* )(CURPTR(p) + S_RESTLEN(p)),
+                              &(p->regs),
+                              match_options(p, target_offset));
         }
+        release_regexp(&sr);
 
-        if (ret == -2) rb_raise(ScanError, "regexp buffer overflow");
         if (ret < 0) {
             /* not matched */
             return Qnil;
         }
+        if (inline_regs) {
+            set_registers(p, ret);
+        }
+        else {
+            CLEAR_INLINE_REGS(p);
+            if (p->fixed_anchor_p && target_offset > 0) {
+                shift_registers(p, target_offset);
+            }
+        }
     }
-    else {
+    else if (headonly && !ignore_case) {
         rb_enc_check(p->str, pattern);
         if (S_RESTLEN(p) < RSTRING_LEN(pattern)) {
             return Qnil;
@@ -617,6 +1771,18 @@ strscan_do_scan(VALUE self, VALUE pattern, int succptr, int getstr, int headonly
         }
         set_registers(p, RSTRING_LEN(pattern));
     }
+    else {
+        long offset, length = -1;
+
+        rb_enc_check(p->str, pattern);
+        offset = scan_literal(p, pattern, headonly, ignore_case, &length);
+        if (offset < 0) {
+            return Qnil;
+        }
+        INLINE_REGS(p);
+        p->beg0 = (p->fixed_anchor_p ? p->curr : 0) + offset;
+        p->end0 = p->beg0 + length;
+    }
 
     MATCHED(p);
     p->prev = p->curr;
@@ -636,7 +1802,7 @@ strscan_do_scan(VALUE self, VALUE pattern, int succptr, int getstr, int headonly
 }
 
 /*
- * call-seq: scan(pattern) => String
+ * call-seq: scan(pattern, ignore_case: false) => String
  *
  * Tries to match with +pattern+ at the current position. If there's a match,
  * the scanner advances the "scan pointer" and returns the matched string.
@@ -650,15 +1816,24 @@ strscan_do_scan(VALUE self, VALUE pattern, int succptr, int getstr, int headonly
  *   p s.scan(/\w+/)   # -> "ing"
  *   p s.scan(/./)     # -> nil
  *
+ * With <tt>ignore_case: true</tt>, a String +pattern+ matches text whose
+ * case folding is the same as its own, as //i would but without building
+ * a Regexp.  ASCII text is compared a word at a time.
+ *
+ *   s = StringScanner.new('Content-Type: text/html')
+ *   p s.scan("CONTENT-TYPE", ignore_case: true)   # -> "Content-Type"
+ *
  */
 static VALUE
-strscan_scan(VALUE self, VALUE re)
+strscan_scan(int argc, VALUE *argv, VALUE self)
 {
-    return strscan_do_scan(self, re, 1, 1, 1);
+    VALUE re;
+    int ignore_case = scan_args(argc, argv, &re);
+    return strscan_do_scan(self, re, 1, 1, 1, ignore_case);
 }
 
 /*
- * call-seq: match?(pattern)
+ * call-seq: match?(pattern, ignore_case: false)
  *
  * Tests whether the given +pattern+ is matched from the current scan pointer.
  * Returns the length of the match, or +nil+.  The scan pointer is not advanced.
@@ -670,13 +1845,15 @@ strscan_scan(VALUE self, VALUE re)
  *   p s.match?(/\s+/)   # -> nil
  */
 static VALUE
-strscan_match_p(VALUE self, VALUE re)
+strscan_match_p(int argc, VALUE *argv, VALUE self)
 {
-    return strscan_do_scan(self, re, 0, 0, 1);
+    VALUE re;
+    int ignore_case = scan_args(argc, argv, &re);
+    return strscan_do_scan(self, re, 0, 0, 1, ignore_case);
 }
 
 /*
- * call-seq: skip(pattern)
+ * call-seq: skip(pattern, ignore_case: false)
  *
  * Attempts to skip over the given +pattern+ beginning with the scan pointer.
  * If it matches, the scan pointer is advanced to the end of the match, and the
@@ -694,13 +1871,15 @@ strscan_match_p(VALUE self, VALUE re)
  *
  */
 static VALUE
-strscan_skip(VALUE self, VALUE re)
+strscan_skip(int argc, VALUE *argv, VALUE self)
 {
-    return strscan_do_scan(self, re, 1, 0, 1);
+    VALUE re;
+    int ignore_case = scan_args(argc, argv, &re);
+    return strscan_do_scan(self, re, 1, 0, 1, ignore_case);
 }
 
 /*
- * call-seq: check(pattern)
+ * call-seq: check(pattern, ignore_case: false)
  *
  * This returns the value that #scan would return, without advancing the scan
  * pointer.  The match register is affected, though.
@@ -715,9 +1894,11 @@ strscan_skip(VALUE self, VALUE re)
  * Mnemonic: it "checks" to see whether a #scan will return a value.
  */
 static VALUE
-strscan_check(VALUE self, VALUE re)
+strscan_check(int argc, VALUE *argv, VALUE self)
 {
-    return strscan_do_scan(self, re, 0, 1, 1);
+    VALUE re;
+    int ignore_case = scan_args(argc, argv, &re);
+    return strscan_do_scan(self, re, 0, 1, 1, ignore_case);
 }
 
 /*
@@ -733,11 +1914,11 @@ strscan_check(VALUE self, VALUE re)
 static VALUE
 strscan_scan_full(VALUE self, VALUE re, VALUE s, VALUE f)
 {
-    return strscan_do_scan(self, re, RTEST(s), RTEST(f), 1);
+    return strscan_do_scan(self, re, RTEST(s), RTEST(f), 1, 0);
 }
 
 /*
- * call-seq: scan_until(pattern)
+ * call-seq: scan_until(pattern, ignore_case: false)
  *
  * Scans the string _until_ the +pattern+ is matched.  Returns the substring up
  * to and including the end of the match, advancing the scan pointer to that
@@ -747,15 +1928,24 @@ strscan_scan_full(VALUE self, VALUE re, VALUE s, VALUE f)
  *   s.scan_until(/1/)        # -> "Fri Dec 1"
  *   s.pre_match              # -> "Fri Dec "
  *   s.scan_until(/XYZ/)      # -> nil
+ *
+ * +pattern+ may also be a String, which is searched for literally, and
+ * <tt>ignore_case: true</tt> works as it does for #scan.
+ *
+ *   s = StringScanner.new("Host: example.com\r\nACCEPT: text/plain")
+ *   s.scan_until("\r\n")                        # -> "Host: example.com\r\n"
+ *   s.scan_until("accept:", ignore_case: true)  # -> "ACCEPT:"
  */
 static VALUE
-strscan_scan_until(VALUE self, VALUE re)
+strscan_scan_until(int argc, VALUE *argv, VALUE self)
 {
-    return strscan_do_scan(self, re, 1, 1, 0);
+    VALUE re;
+    int ignore_case = scan_args(argc, argv, &re);
+    return strscan_do_scan(self, re, 1, 1, 0, ignore_case);
 }
 
 /*
- * call-seq: exist?(pattern)
+ * call-seq: exist?(pattern, ignore_case: false)
  *
  * Looks _ahead_ to see if the +pattern+ exists _anywhere_ in the string,
  * without advancing the scan pointer.  This predicates whether a #scan_until
@@ -768,13 +1958,15 @@ strscan_scan_until(VALUE self, VALUE re)
  *   s.exist? /e/            # -> nil
  */
 static VALUE
-strscan_exist_p(VALUE self, VALUE re)
+strscan_exist_p(int argc, VALUE *argv, VALUE self)
 {
-    return strscan_do_scan(self, re, 0, 0, 0);
+    VALUE re;
+    int ignore_case = scan_args(argc, argv, &re);
+    return strscan_do_scan(self, re, 0, 0, 0, ignore_case);
 }
 
 /*
- * call-seq: skip_until(pattern)
+ * call-seq: skip_until(pattern, ignore_case: false)
  *
  * Advances the scan pointer until +pattern+ is matched and consumed.  Returns
  * the number of bytes advanced, or +nil+ if no match was found.
@@ -790,13 +1982,15 @@ strscan_exist_p(VALUE self, VALUE re)
  *   s                           #
  */
 static VALUE
-strscan_skip_until(VALUE self, VALUE re)
+strscan_skip_until(int argc, VALUE *argv, VALUE self)
 {
-    return strscan_do_scan(self, re, 1, 0, 0);
+    VALUE re;
+    int ignore_case = scan_args(argc, argv, &re);
+    return strscan_do_scan(self, re, 1, 0, 0, ignore_case);
 }
 
 /*
- * call-seq: check_until(pattern)
+ * call-seq: check_until(pattern, ignore_case: false)
  *
  * This returns the value that #scan_until would return, without advancing the
  * scan pointer.  The match register is affected, though.
@@ -809,9 +2003,11 @@ strscan_skip_until(VALUE self, VALUE re)
  * Mnemonic: it "checks" to see whether a #scan_until will return a value.
  */
 static VALUE
-strscan_check_until(VALUE self, VALUE re)
+strscan_check_until(int argc, VALUE *argv, VALUE self)
 {
-    return strscan_do_scan(self, re, 0, 1, 0);
+    VALUE re;
+    int ignore_case = scan_args(argc, argv, &re);
+    return strscan_do_scan(self, re, 0, 1, 0, ignore_case);
 }
 
 /*
@@ -826,99 +2022,1890 @@ strscan_check_until(VALUE self, VALUE re)
 static VALUE
 strscan_search_full(VALUE self, VALUE re, VALUE s, VALUE f)
 {
-    return strscan_do_scan(self, re, RTEST(s), RTEST(f), 0);
+    return strscan_do_scan(self, re, RTEST(s), RTEST(f), 0, 0);
 }
 
-static void
-adjust_registers_to_matched(struct strscanner *p)
+/*
+ * Returns the index of the first String in +patterns+ that occurs at +s+,
+ * or -1.
+ */
+static long
+literal_at(struct strscanner *p, VALUE patterns, const char *s)
 {
-    onig_region_clear(&(p->regs));
-    if (p->fixed_anchor_p) {
-        onig_region_set(&(p->regs), 0, (int)p->prev, (int)p->curr);
-    }
-    else {
-        onig_region_set(&(p->regs), 0, 0, (int)(p->curr - p->prev));
+    const char *end = S_PEND(p);
+    long i;
+
+    for (i = 0; i < RARRAY_LEN(patterns); i++) {
+        VALUE pattern = RARRAY_AREF(patterns, i);
+        long len;
+
+        if (!RB_TYPE_P(pattern, T_STRING)) continue;
+        len = RSTRING_LEN(pattern);
+        if (len == 0 || len > end - s) continue;
+        if (*RSTRING_PTR(pattern) != *s) continue;
+        if (memcmp(RSTRING_PTR(pattern), s, len) != 0) continue;
+        if (!char_head_p(p, s)) continue;
+        return i;
     }
+    return -1;
 }
 
 /*
- * Scans one character and returns it.
- * This method is multibyte character sensitive.
+ * call-seq: scan_until_any(patterns)
  *
- *   s = StringScanner.new("ab")
- *   s.getch           # => "a"
- *   s.getch           # => "b"
- *   s.getch           # => nil
+ * Scans the string _until_ the earliest match of any of +patterns+, an
+ * Array of Strings and Regexps.  Returns the substring up to and
+ * including the end of the match and advances the scan pointer to it, or
+ * returns +nil+ if none of them matches.  If several patterns match at
+ * the same position, the first of them in +patterns+ wins.  Its index is
+ * returned by #matched_pattern_index.
+ *
+ * The Strings are searched together in one pass over the rest of the
+ * string, looking a word at a time for their first bytes when there are
+ * at most three of them.  Each Regexp is then searched only up to the
+ * earliest match found so far.
+ *
+ *   s = StringScanner.new("Hello ${name}, <%= n %>")
+ *   s.scan_until_any(["<%", "${", /\n/])   # -> "Hello ${"
+ *   s.matched_pattern_index                  # -> 1
+ *   s.pre_match                              # -> "Hello "
+ *   s.scan_until_any(["<%", "}"])           # -> "name}"
+ *   s.scan_until_any([/\n/])                # -> nil
+ */
+static VALUE
+strscan_scan_until_any(VALUE self, VALUE patterns)
+{
+    struct strscanner *p;
+    const char *beg, *end, *s;
+    long i, best = -1, best_i = -1, target_offset, register_base;
+    long last_regexp_i = -1, empty_i = -1;
+    unsigned char first[256], first_bytes[3];
+    int n_first = 0, has_literals = 0, ascii_first = 1;
+
+    Check_Type(patterns, T_ARRAY);
+    for (i = 0; i < RARRAY_LEN(patterns); i++) {
+        VALUE pattern = RARRAY_AREF(patterns, i);
+        if (!RB_TYPE_P(pattern, T_STRING) && !RB_TYPE_P(pattern, T_REGEXP)) {
+            rb_raise(rb_eTypeError,
+                     "wrong argument type %"PRIsVALUE" (expected String or Regexp)",
+                     rb_obj_class(pattern));
+        }
+    }
+    GET_SCANNER(self, p);
+
+    CLEAR_MATCH_STATUS(p);
+    if (S_RESTLEN(p) < 0) {
+        return Qnil;
+    }
+
+    beg = S_PBEG(p);
+    end = S_PEND(p);
+    target_offset = match_target_offset(p);
+    register_base = p->fixed_anchor_p ? 0 : p->curr;
+
+    memset(first, 0, sizeof(first));
+    for (i = 0; i < RARRAY_LEN(patterns); i++) {
+        VALUE pattern = RARRAY_AREF(patterns, i);
+        unsigned char c;
+
+        if (!RB_TYPE_P(pattern, T_STRING)) continue;
+        rb_enc_check(p->str, pattern);
+        if (RSTRING_LEN(pattern) == 0) {
+            if (empty_i < 0) empty_i = i;
+            continue;
+        }
+        has_literals = 1;
+        c = RSTRING_PTR(pattern)[0];
+        if (first[c]) continue;
+        first[c] = 1;
+        if (n_first < 3) first_bytes[n_first] = c;
+        n_first++;
+        if (c >= 0x80) ascii_first = 0;
+    }
+
+    if (empty_i >= 0) {
+        /* matches at the scan pointer unless an earlier String does */
+        i = has_literals ? literal_at(p, patterns, CURPTR(p)) : -1;
+        best = p->curr;
+        best_i = (i >= 0 && i < empty_i) ? i : empty_i;
+    }
+    else if (has_literals) {
+        int use_search = n_first <= 3 && ascii_first;
+
+        for (s = CURPTR(p); s < end; s++) {
+            if (use_search) {
+                s = search_ascii_bytes(p, s, end, first_bytes, n_first);
+                if (s == end) break;
+            }
+            else if (!first[(unsigned char)*s]) {
+                continue;
+            }
+            i = literal_at(p, patterns, s);
+            if (i >= 0) {
+                best = s - beg;
+                best_i = i;
+                break;
+            }
+        }
+    }
+
+    for (i = 0; i < RARRAY_LEN(patterns); i++) {
+        VALUE pattern = RARRAY_AREF(patterns, i);
+        struct scan_regexp sr;
+        UChar *range;
+        long ret;
+
+        if (!RB_TYPE_P(pattern, T_REGEXP)) continue;
+        if (best_i >= 0) {
+            /* only a match before the best one, or at it and earlier in
+               patterns, can win; range excludes its own position */
+            if (best == p->curr && i > best_i) break;
+            range = (UChar *)beg + best;
+            if (i < best_i && range < (UChar *)end) range++;
+        }
+        else {
+            range = (UChar *)end;
+        }
+
+        last_regexp_i = i;
+        prepare_regexp(p, pattern, &sr);
+        ret = regexp_exec(p, &sr,
+                          (UChar *)beg + target_offset,
+                          (UChar *)end,
+                          (UChar *)CURPTR(p),
+                          range,
+                          &(p->regs),
+                          match_options(p, target_offset));
+        release_regexp(&sr);
+
+        if (ret < 0) continue;
+        if (best_i >= 0 &&
+            (target_offset + ret > best ||
+             (target_offset + ret == best && i > best_i))) {
+            continue;
+        }
+        best = target_offset + ret;
+        best_i = i;
+    }
+    if (best_i < 0) {
+        return Qnil;
+    }
+
+    if (RB_TYPE_P(RARRAY_AREF(patterns, best_i), T_REGEXP)) {
+        VALUE pattern = RARRAY_AREF(patterns, best_i);
+
+        if (best_i != last_regexp_i) {
+            /* a later search has overwritten the registers */
+            struct scan_regexp sr;
+
+            prepare_regexp(p, pattern, &sr);
+            regexp_exec(p, &sr,
+                        (UChar *)beg + target_offset,
+                        (UChar *)end,
+                        (UChar *)beg + best,
+                        NULL,
+                        &(p->regs),
+                        match_options(p, target_offset));
+            release_regexp(&sr);
+        }
+        p->regex = pattern;
+        CLEAR_INLINE_REGS(p);
+        if (target_offset != register_base) {
+            shift_registers(p, target_offset - register_base);
+        }
+    }
+    else {
+        INLINE_REGS(p);
+        p->beg0 = best - register_base;
+        p->end0 = p->beg0 + RSTRING_LEN(RARRAY_AREF(patterns, best_i));
+    }
+
+    MATCHED(p);
+    PATTERN_INDEX(p);
+    p->pattern_index = best_i;
+    p->prev = p->curr;
+    succ(p);
+    return extract_beg_len(p, p->prev, last_match_length(p));
+}
+
+/*
+ * Returns the index of the pattern matched by the last #scan_until_any,
+ * or +nil+ if the last match was made by another method or failed.
+ */
+static VALUE
+strscan_matched_pattern_index(VALUE self)
+{
+    struct strscanner *p;
+
+    GET_SCANNER(self, p);
+    if (! MATCHED_P(p) || ! PATTERN_INDEX_P(p)) return Qnil;
+    return LONG2NUM(p->pattern_index);
+}
+
+/*
+ * Returns the start of the last occurrence of +pattern+ that ends at or
+ * before +end+, or -1.
+ */
+static long
+rsearch_string(struct strscanner *p, const char *end, VALUE pattern)
+{
+    const char *beg = S_PBEG(p), *s;
+    const char *ptr = RSTRING_PTR(pattern);
+    long len = RSTRING_LEN(pattern);
+    unsigned char last;
+
+    if (len == 0) return end - beg;
+    last = ptr[len - 1];
+    for (s = end - 1; s - beg >= len - 1; s--) {
+        if ((unsigned char)*s != last) continue;
+        if (memcmp(s - len + 1, ptr, len - 1) != 0) continue;
+        if (!char_head_p(p, s - len + 1)) continue;
+        return s - len + 1 - beg;
+    }
+    return -1;
+}
+
+/*
+ * Searches +re+ backward from the scan pointer, treating it as the end of
+ * the string.  If +headonly+, the match has to end at the scan pointer:
+ * the last start the backward search finds has to match up to it, and
+ * the match is then the one from the leftmost start that matches up to
+ * it, so /(?:ab)+/ scans all of "ababab".  Finding that start searches
+ * forward through the text before the match.  Returns the start of the
+ * match, or a negative Onigmo result.
+ */
+static long
+rsearch_regexp(struct strscanner *p, struct scan_regexp *sr, int headonly)
+{
+    UChar *beg = (UChar *)S_PBEG(p);
+    UChar *end = (UChar *)CURPTR(p);
+    rb_encoding *enc = rb_enc_get(p->str);
+    long ret, start, s;
+
+    ret = regexp_exec(p, sr, beg, end, end, beg, &(p->regs), ONIG_OPTION_NONE);
+    if (!headonly || ret < 0) return ret;
+    if (p->regs.end[0] != end - beg) return ONIG_MISMATCH;
+    if (ret == 0) return ret;
+
+    for (s = 0; s < ret; s += rb_enc_mbclen((char *)beg + s, (char *)end, enc)) {
+        start = regexp_exec(p, sr, beg, end, beg + s, beg + ret, &(p->regs),
+                            ONIG_OPTION_NONE);
+        if (start < 0 || start >= ret) break;
+        if (p->regs.end[0] == end - beg) return start;
+        s = start;
+    }
+    regexp_exec(p, sr, beg, end, beg + ret, NULL, &(p->regs), ONIG_OPTION_NONE);
+    return ret;
+}
+
+static VALUE
+strscan_do_scan_backward(VALUE self, VALUE pattern, int succptr, int getstr,
+                         int headonly)
+{
+    struct strscanner *p;
+    long beg_i;
+
+    if (!RB_TYPE_P(pattern, T_REGEXP)) {
+        StringValue(pattern);
+    }
+    GET_SCANNER(self, p);
+
+    CLEAR_MATCH_STATUS(p);
+    if (S_RESTLEN(p) < 0) {
+        return Qnil;
+    }
+
+    if (RB_TYPE_P(pattern, T_REGEXP)) {
+        struct scan_regexp sr;
+
+        p->regex = pattern;
+        prepare_regexp(p, pattern, &sr);
+        beg_i = rsearch_regexp(p, &sr, headonly);
+        release_regexp(&sr);
+
+        if (beg_i < 0) {
+            /* not matched */
+            return Qnil;
+        }
+        CLEAR_INLINE_REGS(p);
+    }
+    else {
+        long len = RSTRING_LEN(pattern);
+
+        rb_enc_check(p->str, pattern);
+        if (headonly) {
+            beg_i = p->curr - len;
+            if (beg_i < 0 ||
+                memcmp(S_PBEG(p) + beg_i, RSTRING_PTR(pattern), len) != 0 ||
+                !char_head_p(p, S_PBEG(p) + beg_i)) {
+                return Qnil;
+            }
+        }
+        else {
+            beg_i = rsearch_string(p, CURPTR(p), pattern);
+            if (beg_i < 0) return Qnil;
+        }
+        INLINE_REGS(p);
+        p->beg0 = beg_i;
+        p->end0 = beg_i + len;
+    }
+
+    MATCHED(p);
+    ABSOLUTE_REGS(p);
+    p->prev = p->curr;
+
+    if (succptr) {
+        p->curr = beg_i;
+    }
+    if (getstr) {
+        return extract_range(p, beg_i, p->prev);
+    }
+    else {
+        return LONG2NUM(p->prev - beg_i);
+    }
+}
+
+/*
+ * call-seq: scan_backward(pattern)
+ *
+ * Tries to match +pattern+ so that the match _ends_ at the scan pointer,
+ * treating the scan pointer as the end of the string.  If there's a
+ * match, the scan pointer moves back to its start and the matched string
+ * is returned.  Otherwise, returns +nil+.
+ *
+ * The last place +pattern+ matches from, searching backward, has to match
+ * up to the scan pointer.  The match returned is then the one from the
+ * leftmost start that matches up to the scan pointer, so <tt>/\d+/</tt>
+ * scans all trailing digits and <tt>/(?:ab)+/</tt> all trailing "ab"s.
+ * Finding that start searches the text before the match.  The match
+ * register is set as usual, and #unscan returns to the previous position.
+ *
+ *   s = StringScanner.new("total: 1975")
+ *   s.terminate
+ *   s.scan_backward(/\d+/)      # -> "1975"
+ *   s.pre_match                  # -> "total: "
+ *   s.scan_backward(": ")        # -> ": "
+ *   s.pos                        # -> 5
+ */
+static VALUE
+strscan_scan_backward(VALUE self, VALUE re)
+{
+    return strscan_do_scan_backward(self, re, 1, 1, 1);
+}
+
+/*
+ * call-seq: skip_backward_until(pattern)
+ *
+ * Searches backward for the last match of +pattern+ that ends at or
+ * before the scan pointer and moves the scan pointer back to its start.
+ * Returns the number of bytes moved, or +nil+ if there's no match.
+ *
+ *   s = StringScanner.new("a=1;b=2;c=3")
+ *   s.terminate
+ *   s.skip_backward_until(";")   # -> 4
+ *   s.matched                    # -> ";"
+ *   s.post_match                 # -> "c=3"
+ *   s.skip_backward_until(/=/)   # -> 2
+ *   s.pos                        # -> 5
+ */
+static VALUE
+strscan_skip_backward_until(VALUE self, VALUE re)
+{
+    return strscan_do_scan_backward(self, re, 1, 0, 0);
+}
+
+/*
+ * call-seq: rcheck(pattern)
+ *
+ * This returns the value that #scan_backward would return, without moving
+ * the scan pointer.  The match register is affected, though.
+ *
+ *   s = StringScanner.new("log line *1A")
+ *   s.terminate
+ *   s.rcheck(/\*\h+/)            # -> "*1A"
+ *   s.pos                        # -> 12
+ */
+static VALUE
+strscan_rcheck(VALUE self, VALUE re)
+{
+    return strscan_do_scan_backward(self, re, 0, 1, 1);
+}
+
+/* Returns the index of the first checkpoint at or after +pos+. */
+static long
+checkpoint_index(struct strscanner *p, long pos)
+{
+    long lo = 0, hi = p->n_checkpoints;
+
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        if (p->checkpoints[mid] < pos) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Removes the checkpoints from index +from+ up to, not including, +to+. */
+static void
+remove_checkpoints(struct strscanner *p, long from, long to)
+{
+    if (from >= to) return;
+    MEMMOVE(p->checkpoints + from, p->checkpoints + to, long,
+            p->n_checkpoints - to);
+    p->n_checkpoints -= to - from;
+}
+
+/*
+ * Removes the checkpoints between the last checkpoint call and +pos+,
+ * which scanning has passed over, and returns the index +pos+ would have.
+ */
+static long
+drop_passed_checkpoints(struct strscanner *p, long pos)
+{
+    long i = checkpoint_index(p, pos), j;
+
+    if (p->last_checkpoint >= 0 && p->last_checkpoint < pos) {
+        j = checkpoint_index(p, p->last_checkpoint + 1);
+        remove_checkpoints(p, j, i);
+        i = j;
+    }
+    return i;
+}
+
+/*
+ * Returns the code range of +str+ once +text+ replaces some of it.  Only
+ * a 7-bit string is known to stay so; the edit may remove the only
+ * non-ASCII bytes of any other, so it's left to be scanned again.
+ */
+static int
+splice_coderange(VALUE str, VALUE text)
+{
+    if (ENC_CODERANGE(str) == ENC_CODERANGE_7BIT) {
+        return rb_enc_str_coderange(text);
+    }
+    return ENC_CODERANGE_UNKNOWN;
+}
+
+/*
+ * call-seq: replace(range, text)
+ *
+ * Replaces the bytes of the scanned string in +range+ with +text+, in
+ * place, for rescanning only what an edit may have changed.  Returns the
+ * position scanning resumes from: the last checkpoint before the edit,
+ * or 0.  The scan pointer is moved there, the match data is cleared and
+ * the limit is removed.
+ *
+ * Checkpoints from there up to the end of +range+ are dropped, as are
+ * those passed over since the last #checkpoint, and those after it are
+ * moved by the change in length.  These stay until
+ * rescanning records a checkpoint at or past them (see #checkpoint).
+ *
+ *   s = StringScanner.new("a = 1; b = 2")
+ *   until s.eos?
+ *     s.skip(/\s+/)
+ *     s.checkpoint
+ *     s.scan(/\w+|\S/)
+ *   end
+ *   s.replace(4...5, "42")   # -> 2
+ *   s.string                 # -> "a = 42; b = 2"
+ *   s.scan(/\S+/)            # -> "="
+ */
+static VALUE
+strscan_replace(VALUE self, VALUE range, VALUE text)
+{
+    struct strscanner *p;
+    long beg, len, end, delta, text_len, str_len, safe, i, j, k;
+    VALUE str;
+    rb_encoding *enc;
+    char *ptr;
+    int cr;
+
+    GET_SCANNER(self, p);
+    str = p->str;
+    StringValue(text);
+    if (text == str) text = rb_str_dup(text);
+    switch (rb_range_beg_len(range, &beg, &len, RSTRING_LEN(str), 0)) {
+      case Qfalse:
+        rb_raise(rb_eTypeError, "wrong argument type %"PRIsVALUE" (expected Range)",
+                 rb_obj_class(range));
+      case Qnil:
+        rb_raise(rb_eRangeError, "%+"PRIsVALUE" out of range", range);
+    }
+    enc = rb_enc_check(str, text);
+    end = beg + len;
+    if (!char_head_p(p, S_PBEG(p) + beg) ||
+        (end < RSTRING_LEN(str) && !char_head_p(p, S_PBEG(p) + end))) {
+        rb_raise(rb_eIndexError, "range does not land on character boundaries");
+    }
+
+    cr = splice_coderange(str, text);
+    text_len = RSTRING_LEN(text);
+    str_len = RSTRING_LEN(str);
+    delta = text_len - len;
+    rb_str_modify_expand(str, delta > 0 ? delta : 0);
+    ptr = RSTRING_PTR(str);
+    memmove(ptr + beg + text_len, ptr + end, str_len - end);
+    memcpy(ptr + beg, RSTRING_PTR(text), text_len);
+    rb_str_set_len(str, str_len + delta);
+    rb_enc_associate(str, enc);
+    ENC_CODERANGE_SET(str, cr);
+
+    drop_passed_checkpoints(p, p->curr);
+    /* A token ending at or right before the edit may extend into it, so
+       only the checkpoint before that one is safe.  It's dropped too, so
+       that checkpoint only finds those after the edit. */
+    i = checkpoint_index(p, beg);
+    if (i > 0) i--;
+    safe = i < p->n_checkpoints && p->checkpoints[i] < beg ? p->checkpoints[i] : 0;
+    j = checkpoint_index(p, end + 1);
+    for (k = j; k < p->n_checkpoints; k++) {
+        p->checkpoints[k] += delta;
+    }
+    remove_checkpoints(p, i, j);
+
+    p->curr = safe;
+    p->last_checkpoint = safe;
+    p->window_head = 0;
+    p->str_generation++;
+    CLEAR_LIMITED(p);
+    CLEAR_MATCH_STATUS(p);
+    cache_string(p);
+    return LONG2NUM(safe);
+}
+
+/*
+ * call-seq: checkpoint
+ *
+ * Records the scan pointer as a token boundary that scanning can resume
+ * from after #replace.  Call it between tokens.
+ *
+ * Returns +true+ if it was recorded already, which after #replace means
+ * the new tokens have lined up with the old ones again and the rest
+ * needn't be rescanned.  Otherwise, returns +false+.  Checkpoints passed
+ * over since the last call are dropped, as they aren't token boundaries
+ * anymore.
+ *
+ *   s = StringScanner.new("ab cd")
+ *   s.checkpoint      # -> false
+ *   s.skip(/ab /)
+ *   s.checkpoint      # -> false
+ *   s.replace(0..1, "x")
+ *   s.skip(/x /)
+ *   s.checkpoint      # -> true
+ *   s.checkpoints     # -> [2]
+ */
+static VALUE
+strscan_checkpoint(VALUE self)
+{
+    struct strscanner *p;
+    long pos, i;
+    int found;
+
+    GET_SCANNER(self, p);
+    pos = p->curr;
+    i = drop_passed_checkpoints(p, pos);
+    found = i < p->n_checkpoints && p->checkpoints[i] == pos;
+    if (!found) {
+        if (p->n_checkpoints == p->checkpoints_capa) {
+            p->checkpoints_capa = p->checkpoints_capa ? p->checkpoints_capa * 2 : 16;
+            REALLOC_N(p->checkpoints, long, p->checkpoints_capa);
+        }
+        MEMMOVE(p->checkpoints + i + 1, p->checkpoints + i, long,
+                p->n_checkpoints - i);
+        p->checkpoints[i] = pos;
+        p->n_checkpoints++;
+    }
+    p->last_checkpoint = pos;
+    return found ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq: checkpoints
+ *
+ * Returns the positions recorded by #checkpoint, in order, except those
+ * the scan pointer has passed since the last call to #checkpoint.
+ *
+ *   s = StringScanner.new("ab cd")
+ *   s.checkpoint
+ *   s.skip(/ab /)
+ *   s.checkpoint
+ *   s.checkpoints     # -> [0, 3]
+ */
+static VALUE
+strscan_checkpoints(VALUE self)
+{
+    struct strscanner *p;
+    VALUE ary;
+    long i;
+
+    GET_SCANNER(self, p);
+    drop_passed_checkpoints(p, p->curr);
+    ary = rb_ary_new_capa(p->n_checkpoints);
+    for (i = 0; i < p->n_checkpoints; i++) {
+        rb_ary_push(ary, LONG2NUM(p->checkpoints[i]));
+    }
+    return ary;
+}
+
+static void
+adjust_registers_to_matched(struct strscanner *p)
+{
+    INLINE_REGS(p);
+    if (p->fixed_anchor_p) {
+        p->beg0 = p->prev;
+        p->end0 = p->curr;
+    }
+    else {
+        p->beg0 = 0;
+        p->end0 = p->curr - p->prev;
+    }
+}
+
+/*
+ * Scans one character and returns it.
+ * This method is multibyte character sensitive.
+ *
+ *   s = StringScanner.new("ab")
+ *   s.getch           # => "a"
+ *   s.getch           # => "b"
+ *   s.getch           # => nil
  *
  *   s = StringScanner.new("\244\242".force_encoding("euc-jp"))
  *   s.getch           # => "\x{A4A2}"   # Japanese hira-kana "A" in EUC-JP
  *   s.getch           # => nil
  */
 static VALUE
-strscan_getch(VALUE self)
+strscan_getch(VALUE self)
+{
+    struct strscanner *p;
+    long len;
+
+    GET_SCANNER(self, p);
+    CLEAR_MATCH_STATUS(p);
+    if (EOS_P(p))
+        return Qnil;
+
+    if (ASCII_ONLY_P(p)) {
+        len = 1;
+    }
+    else {
+        len = rb_enc_mbclen(CURPTR(p), S_PEND(p), rb_enc_get(p->str));
+        len = minl(len, S_RESTLEN(p));
+    }
+    p->prev = p->curr;
+    p->curr += len;
+    MATCHED(p);
+    adjust_registers_to_matched(p);
+    return extract_range(p,
+                         adjust_register_position(p, REG_BEG(p, 0)),
+                         adjust_register_position(p, REG_END(p, 0)));
+}
+
+/*
+ * Scans one byte and returns it.
+ * This method is not multibyte character sensitive.
+ * See also: #getch.
+ *
+ *   s = StringScanner.new('ab')
+ *   s.get_byte         # => "a"
+ *   s.get_byte         # => "b"
+ *   s.get_byte         # => nil
+ *
+ *   s = StringScanner.new("\244\242".force_encoding("euc-jp"))
+ *   s.get_byte         # => "\xA4"
+ *   s.get_byte         # => "\xA2"
+ *   s.get_byte         # => nil
+ */
+static VALUE
+strscan_get_byte(VALUE self)
+{
+    struct strscanner *p;
+
+    GET_SCANNER(self, p);
+    CLEAR_MATCH_STATUS(p);
+    if (EOS_P(p))
+        return Qnil;
+
+    p->prev = p->curr;
+    p->curr++;
+    MATCHED(p);
+    adjust_registers_to_matched(p);
+    return extract_range(p,
+                         adjust_register_position(p, REG_BEG(p, 0)),
+                         adjust_register_position(p, REG_END(p, 0)));
+}
+
+/*
+ * Equivalent to #get_byte.
+ * This method is obsolete; use #get_byte instead.
+ */
+static VALUE
+strscan_getbyte(VALUE self)
+{
+    rb_warning("StringScanner#getbyte is obsolete; use #get_byte instead");
+    return strscan_get_byte(self);
+}
+
+/* Whether +endian+, :big (the default), :little or :native, is little. */
+static int
+little_endian_p(VALUE endian)
+{
+    ID id;
+
+    if (NIL_P(endian)) return 0;
+    id = SYMBOL_P(endian) ? SYM2ID(endian) : 0;
+    if (id == rb_intern("big")) return 0;
+    if (id == rb_intern("little")) return 1;
+    if (id == rb_intern("native")) {
+#ifdef WORDS_BIGENDIAN
+        return 0;
+#else
+        return 1;
+#endif
+    }
+    rb_raise(rb_eArgError, "invalid endian: %+"PRIsVALUE, endian);
+}
+
+static uint64_t
+read_uint(const char *s, int width, int little)
+{
+    const unsigned char *u = (const unsigned char *)s;
+    uint64_t value = 0;
+    int i;
+
+    if (little) {
+        for (i = width - 1; i >= 0; i--) value = (value << 8) | u[i];
+    }
+    else {
+        for (i = 0; i < width; i++) value = (value << 8) | u[i];
+    }
+    return value;
+}
+
+/*
+ * Decodes the unsigned LEB128 varint at +s+ into *value.  Returns its
+ * length, 0 if it's cut off by +end+, or -1 if it doesn't fit in 64 bits.
+ */
+static long
+read_varint(const char *s, const char *end, uint64_t *value)
+{
+    const unsigned char *u = (const unsigned char *)s;
+    uint64_t v = 0;
+    long i;
+
+    for (i = 0; s + i < end; i++) {
+        uint64_t bits = u[i] & 0x7f;
+        if (i == 9 ? bits > 1 : i > 9) return -1;
+        v |= bits << (7 * i);
+        if (!(u[i] & 0x80)) {
+            *value = v;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+/* Consumes the +length+ bytes of a binary field at the scan pointer. */
+static void
+scan_binary(struct strscanner *p, long length)
+{
+    set_registers(p, length);
+    MATCHED(p);
+    p->prev = p->curr;
+    succ(p);
+}
+
+static VALUE
+scan_uint(int argc, VALUE *argv, VALUE self, int width)
+{
+    struct strscanner *p;
+    VALUE endian;
+    uint64_t value;
+    int little;
+
+    rb_scan_args(argc, argv, "01", &endian);
+    little = little_endian_p(endian);
+    GET_SCANNER(self, p);
+
+    CLEAR_MATCH_STATUS(p);
+    if (S_RESTLEN(p) < width) return Qnil;
+    value = read_uint(CURPTR(p), width, little);
+    scan_binary(p, width);
+    return ULL2NUM(value);
+}
+
+/*
+ * call-seq: scan_u8
+ *
+ * Scans a byte as an unsigned integer.  Returns +nil+ at the end of the
+ * string.
+ *
+ *   s = StringScanner.new("\x01\xff")
+ *   s.scan_u8   # -> 1
+ *   s.scan_u8   # -> 255
+ *   s.scan_u8   # -> nil
+ */
+static VALUE
+strscan_scan_u8(VALUE self)
+{
+    return scan_uint(0, NULL, self, 1);
+}
+
+/*
+ * call-seq: scan_u16(endian = :big)
+ *
+ * Scans a 16-bit unsigned integer in +endian+ byte order, +:big+,
+ * +:little+ or +:native+.  Returns +nil+ without advancing if fewer than
+ * 2 bytes remain.
+ *
+ *   s = StringScanner.new("\x01\x02\x01\x02")
+ *   s.scan_u16            # -> 258
+ *   s.scan_u16(:little)   # -> 513
+ */
+static VALUE
+strscan_scan_u16(int argc, VALUE *argv, VALUE self)
+{
+    return scan_uint(argc, argv, self, 2);
+}
+
+/*
+ * call-seq: scan_u32(endian = :big)
+ *
+ * Same as #scan_u16, but for a 32-bit unsigned integer.
+ */
+static VALUE
+strscan_scan_u32(int argc, VALUE *argv, VALUE self)
+{
+    return scan_uint(argc, argv, self, 4);
+}
+
+/*
+ * call-seq: scan_u64(endian = :big)
+ *
+ * Same as #scan_u16, but for a 64-bit unsigned integer.
+ */
+static VALUE
+strscan_scan_u64(int argc, VALUE *argv, VALUE self)
+{
+    return scan_uint(argc, argv, self, 8);
+}
+
+/*
+ * call-seq: scan_varint
+ *
+ * Scans an unsigned LEB128 varint, as used by Protocol Buffers.  Returns
+ * +nil+ without advancing if it's cut off by the end of the string, and
+ * raises RangeError if it doesn't fit in 64 bits.
+ *
+ *   s = StringScanner.new("\x96\x01\x7f")
+ *   s.scan_varint   # -> 150
+ *   s.scan_varint   # -> 127
+ */
+static VALUE
+strscan_scan_varint(VALUE self)
+{
+    struct strscanner *p;
+    uint64_t value;
+    long length;
+
+    GET_SCANNER(self, p);
+    CLEAR_MATCH_STATUS(p);
+    if (EOS_P(p)) return Qnil;
+    length = read_varint(CURPTR(p), S_PEND(p), &value);
+    if (length < 0) rb_raise(rb_eRangeError, "varint exceeds 64 bits");
+    if (length == 0) return Qnil;
+    scan_binary(p, length);
+    return ULL2NUM(value);
+}
+
+/*
+ * call-seq: scan_length_prefixed(width, endian = :big)
+ *
+ * Scans a block of bytes preceded by its length, an unsigned integer of
+ * +width+ bytes (1, 2, 4 or 8) in +endian+ byte order, or a varint if
+ * +width+ is +:varint+.  Returns the block without its length, or +nil+
+ * without advancing if the string ends before the block does.  The
+ * match register is set to the whole record.
+ *
+ *   s = StringScanner.new("\x00\x03abc\x02de")
+ *   s.scan_length_prefixed(2)         # -> "abc"
+ *   s.scan_length_prefixed(:varint)   # -> "de"
+ */
+static VALUE
+strscan_scan_length_prefixed(int argc, VALUE *argv, VALUE self)
+{
+    struct strscanner *p;
+    VALUE width, endian;
+    uint64_t length;
+    long header;
+    int little;
+
+    rb_scan_args(argc, argv, "11", &width, &endian);
+    little = little_endian_p(endian);
+    if (SYMBOL_P(width) && SYM2ID(width) == rb_intern("varint")) {
+        header = -1;
+    }
+    else {
+        header = NUM2LONG(width);
+        if (header != 1 && header != 2 && header != 4 && header != 8) {
+            rb_raise(rb_eArgError, "invalid width: %+"PRIsVALUE, width);
+        }
+    }
+    GET_SCANNER(self, p);
+
+    CLEAR_MATCH_STATUS(p);
+    if (header < 0) {
+        header = read_varint(CURPTR(p), S_PEND(p), &length);
+        if (header < 0) rb_raise(rb_eRangeError, "varint exceeds 64 bits");
+        if (header == 0) return Qnil;
+    }
+    else {
+        if (S_RESTLEN(p) < header) return Qnil;
+        length = read_uint(CURPTR(p), (int)header, little);
+    }
+    if (length > (uint64_t)(S_RESTLEN(p) - header)) return Qnil;
+
+    scan_binary(p, header + (long)length);
+    return extract_range(p, p->prev + header, p->curr);
+}
+
+/* Returns the number of bytes of +word+ that aren't UTF-8 continuation
+   bytes (10xxxxxx), i.e. the number of characters starting in it. */
+static inline long
+utf8_lead_bytes(uint64_t word)
+{
+    uint64_t continuation = word & ~(word << 1) & WORD_MSB;
+    return (long)sizeof(word) - (long)(((continuation >> 7) * WORD_LSB) >> 56);
+}
+
+/* The byte length of the first +n+ characters of valid UTF-8 text, or
+   -1 if there are fewer.  Counts lead bytes a word at a time. */
+static long
+utf8_chars_length(const char *beg, const char *end, long n)
+{
+    const char *s = beg;
+
+    while (end - s >= (long)sizeof(uint64_t)) {
+        uint64_t word;
+        long leads;
+
+        memcpy(&word, s, sizeof(word));
+        leads = utf8_lead_bytes(word);
+        /* stop before the word holding the first byte after n characters */
+        if (leads > n) break;
+        n -= leads;
+        s += sizeof(word);
+    }
+    for (; s < end; s++) {
+        if ((*s & 0xc0) == 0x80) continue;
+        if (n == 0) return s - beg;
+        n--;
+    }
+    return (n == 0) ? s - beg : -1;
+}
+
+/* The byte length of the first +n+ characters from the scan pointer,
+   or -1 if there are fewer. */
+static long
+chars_length(struct strscanner *p, long n)
+{
+    const char *s = CURPTR(p), *end = S_PEND(p);
+    rb_encoding *enc;
+
+    if (ASCII_ONLY_P(p)) {
+        return (n <= S_RESTLEN(p)) ? n : -1;
+    }
+    if (ENC_CODERANGE(p->str) == ENC_CODERANGE_VALID &&
+        ENCODING_GET(p->str) == rb_utf8_encindex()) {
+        return utf8_chars_length(s, end, n);
+    }
+
+    enc = rb_enc_get(p->str);
+    for (; n > 0; n--) {
+        if (s >= end) return -1;
+        s += minl(rb_enc_mbclen(s, end, enc), end - s);
+    }
+    return s - CURPTR(p);
+}
+
+static VALUE
+strscan_do_scan_chars(VALUE self, VALUE vn, int getstr)
+{
+    struct strscanner *p;
+    long n, len;
+
+    GET_SCANNER(self, p);
+    n = NUM2LONG(vn);
+    if (n < 0) rb_raise(rb_eArgError, "negative character count");
+
+    CLEAR_MATCH_STATUS(p);
+    if (S_RESTLEN(p) < 0) return Qnil;
+    len = chars_length(p, n);
+    if (len < 0) return Qnil;
+
+    p->prev = p->curr;
+    p->curr += len;
+    MATCHED(p);
+    adjust_registers_to_matched(p);
+    if (getstr) {
+        return extract_range(p, p->prev, p->curr);
+    }
+    else {
+        return INT2FIX(len);
+    }
+}
+
+/*
+ * call-seq: scan_chars(n)
+ *
+ * Scans +n+ characters and returns them as one string, or returns +nil+
+ * if fewer than +n+ characters are left.  This method is multibyte
+ * character sensitive and sets the match register like #getch.
+ *
+ *   s = StringScanner.new("r\u00e9sum\u00e9 2024")
+ *   s.scan_chars(6)   # => "r\u00e9sum\u00e9"
+ *   s.pos             # => 8
+ *   s.scan_chars(6)   # => nil
+ */
+static VALUE
+strscan_scan_chars(VALUE self, VALUE n)
+{
+    return strscan_do_scan_chars(self, n, 1);
+}
+
+/*
+ * call-seq: skip_chars(n)
+ *
+ * Same as #scan_chars, but returns the number of bytes advanced instead
+ * of the scanned string.
+ *
+ *   s = StringScanner.new("r\u00e9sum\u00e9 2024")
+ *   s.skip_chars(6)   # => 8
+ */
+static VALUE
+strscan_skip_chars(VALUE self, VALUE n)
+{
+    return strscan_do_scan_chars(self, n, 0);
+}
+
+static int
+ascii_byte_option(VALUE value, const char *name)
+{
+    StringValue(value);
+    if (RSTRING_LEN(value) != 1 || (unsigned char)RSTRING_PTR(value)[0] >= 0x80) {
+        rb_raise(rb_eArgError, "%s must be a single ASCII character: %+"PRIsVALUE,
+                 name, value);
+    }
+    return (unsigned char)RSTRING_PTR(value)[0];
+}
+
+static int
+hex4(const char *s, const char *end)
+{
+    int i, c, code = 0;
+
+    if (end - s < 4) return -1;
+    for (i = 0; i < 4; i++) {
+        c = (unsigned char)s[i];
+        if ('0' <= c && c <= '9') c -= '0';
+        else if ('a' <= c && c <= 'f') c -= 'a' - 10;
+        else if ('A' <= c && c <= 'F') c -= 'A' - 10;
+        else return -1;
+        code = code * 16 + c;
+    }
+    return code;
+}
+
+/*
+ * Appends the character escaped by the escape character at *sp to +str+
+ * and advances *sp past the escape sequence.
+ */
+static void
+append_unescaped(struct strscanner *p, VALUE str, const char **sp, const char *end)
+{
+    const char *s = *sp + 1;
+    char c;
+    int code, low;
+
+    switch (*s) {
+      case 'b': c = '\b'; break;
+      case 'f': c = '\f'; break;
+      case 'n': c = '\n'; break;
+      case 'r': c = '\r'; break;
+      case 't': c = '\t'; break;
+      case 'v': c = '\v'; break;
+      case 'u':
+        code = hex4(s + 1, end);
+        if (code < 0 || ENCODING_GET(p->str) != rb_utf8_encindex()) goto literal;
+        s += 5;
+        if (0xd800 <= code && code < 0xdc00) {
+            if (end - s >= 6 && s[0] == **sp && s[1] == 'u' &&
+                (low = hex4(s + 2, end)) >= 0xdc00 && low < 0xe000) {
+                code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                s += 6;
+            }
+            else {
+                code = 0xfffd;
+            }
+        }
+        else if (0xdc00 <= code && code < 0xe000) {
+            code = 0xfffd;
+        }
+        {
+            char buf[4];
+            rb_str_cat(str, buf, rb_enc_mbcput(code, buf, rb_utf8_encoding()));
+        }
+        *sp = s;
+        return;
+      default:
+      literal:
+        code = rb_enc_mbclen(s, end, rb_enc_get(p->str));
+        code = (int)minl(code, end - s);
+        rb_str_cat(str, s, code);
+        *sp = s + code;
+        return;
+    }
+    rb_str_cat(str, &c, 1);
+    *sp = s + 1;
+}
+
+/*
+ * call-seq:
+ *   scan_quoted(quote: '"', escape: '\\', unescape: true)
+ *
+ * Scans a string literal that starts with +quote+ at the scan pointer
+ * and ends with the next unescaped +quote+.  Returns the content between
+ * the quotes, or +nil+ if there is no opening quote at the scan pointer
+ * or no closing quote.  The match register is set to the whole literal,
+ * quotes included.
+ *
+ * An +escape+ character followed by another character stands for that
+ * character, except that <tt>\\b</tt>, <tt>\\f</tt>, <tt>\\n</tt>,
+ * <tt>\\r</tt>, <tt>\\t</tt>, <tt>\\v</tt> stand for the control
+ * characters and <tt>\\uXXXX</tt> for a Unicode character in UTF-8
+ * strings (surrogate pairs included).  If +escape+ is the same as
+ * +quote+, a doubled quote stands for one quote as in CSV.  If +escape+
+ * is +nil+, nothing is escaped.
+ *
+ * The content is unescaped while the closing quote is searched for,
+ * unless +unescape+ is +false+, in which case it is returned as is.
+ *
+ *   s = StringScanner.new('"say \\"hi\\"\\n" rest')
+ *   s.scan_quoted                    # -> "say \"hi\"\n"
+ *   s.matched                        # -> "\"say \\\"hi\\\"\\n\""
+ *
+ *   s = StringScanner.new("'it''s',1")
+ *   s.scan_quoted(quote: "'", escape: "'")   # -> "it's"
+ */
+static VALUE
+strscan_scan_quoted(int argc, VALUE *argv, VALUE self)
+{
+    struct strscanner *p;
+    VALUE options, result = Qnil;
+    int quote = '"', escape = '\\', unescape = 1, n_bytes;
+    unsigned char bytes[2] = {0, 0};
+    const char *beg, *s, *segment, *end;
+
+    rb_scan_args(argc, argv, "0:", &options);
+    if (!NIL_P(options)) {
+        ID keyword_ids[3];
+        VALUE values[3];
+        keyword_ids[0] = rb_intern("quote");
+        keyword_ids[1] = rb_intern("escape");
+        keyword_ids[2] = rb_intern("unescape");
+        rb_get_kwargs(options, keyword_ids, 0, 3, values);
+        if (values[0] != Qundef) quote = ascii_byte_option(values[0], "quote");
+        if (values[1] != Qundef) {
+            escape = NIL_P(values[1]) ? -1 : ascii_byte_option(values[1], "escape");
+        }
+        if (values[2] != Qundef) unescape = RTEST(values[2]);
+    }
+    GET_SCANNER(self, p);
+
+    CLEAR_MATCH_STATUS(p);
+    if (S_RESTLEN(p) <= 0) return Qnil;
+    beg = CURPTR(p);
+    end = S_PEND(p);
+    if ((unsigned char)*beg != quote) return Qnil;
+
+    bytes[0] = quote;
+    n_bytes = 1;
+    if (escape >= 0 && escape != quote) bytes[n_bytes++] = escape;
+    segment = s = beg + 1;
+    for (;;) {
+        s = search_ascii_bytes(p, s, end, bytes, n_bytes);
+        if (s == end) return Qnil;
+        if ((unsigned char)*s == quote) {
+            if (escape != quote || s + 1 == end || (unsigned char)s[1] != quote) {
+                break;
+            }
+            /* doubled quote */
+            if (unescape) {
+                if (NIL_P(result)) result = str_new(p, "", 0);
+                rb_str_cat(result, segment, s + 1 - segment);
+            }
+            s += 2;
+        }
+        else {
+            if (s + 1 == end) return Qnil;
+            if (unescape) {
+                if (NIL_P(result)) result = str_new(p, "", 0);
+                rb_str_cat(result, segment, s - segment);
+                append_unescaped(p, result, &s, end);
+            }
+            else {
+                s += 1 + minl(rb_enc_mbclen(s + 1, end, rb_enc_get(p->str)),
+                              end - s - 1);
+            }
+        }
+        segment = s;
+    }
+
+    set_registers(p, s + 1 - beg);
+    MATCHED(p);
+    p->prev = p->curr;
+    succ(p);
+    if (NIL_P(result)) {
+        return extract_range(p, p->prev + 1, p->curr - 1);
+    }
+    rb_str_cat(result, segment, s - segment);
+    ENC_CODERANGE_CLEAR(result);
+    return result;
+}
+
+/*
+ * call-seq: scan_ident_in(table)
+ *
+ * Scans an identifier at the scan pointer, as Ruby's own identifiers: a
+ * letter, an underscore or a non-ASCII character, then any number of
+ * those and digits.  Returns <tt>table[identifier]</tt> if +table+, a
+ * Hash with String keys, has the identifier, or the identifier itself
+ * otherwise.  Returns +nil+ if there is no identifier at the scan
+ * pointer.  The default value of +table+ isn't used.
+ *
+ * The identifier is only allocated as a String when +table+ doesn't have
+ * it, so scanning keywords allocates nothing.
+ *
+ *   KEYWORDS = {"if" => :if, "end" => :end}
+ *   s = StringScanner.new("if x end")
+ *   s.scan_ident_in(KEYWORDS)   # -> :if
+ *   s.skip(/ /)
+ *   s.scan_ident_in(KEYWORDS)   # -> "x"
+ *   s.matched                   # -> "x"
+ */
+static VALUE
+strscan_scan_ident_in(VALUE self, VALUE table)
+{
+    struct strscanner *p;
+    rb_encoding *enc;
+    const char *beg, *s, *end;
+    VALUE key, value;
+
+    Check_Type(table, T_HASH);
+    GET_SCANNER(self, p);
+
+    CLEAR_MATCH_STATUS(p);
+    enc = rb_enc_get(p->str);
+    if (!rb_enc_asciicompat(enc)) {
+        rb_raise(rb_eEncCompatError, "ASCII incompatible encoding: %s",
+                 rb_enc_name(enc));
+    }
+    if (S_RESTLEN(p) <= 0) return Qnil;
+    s = beg = CURPTR(p);
+    end = S_PEND(p);
+    while (s < end) {
+        unsigned char c = *s;
+        if (c >= 0x80) {
+            s += minl(rb_enc_mbclen(s, end, enc), end - s);
+        }
+        else if (c == '_' || rb_isalpha(c) || (s > beg && rb_isdigit(c))) {
+            s++;
+        }
+        else {
+            break;
+        }
+    }
+    if (s == beg) return Qnil;
+
+    set_registers(p, s - beg);
+    MATCHED(p);
+    p->prev = p->curr;
+    succ(p);
+
+    key = p->ident_key;
+    if (NIL_P(key)) {
+        key = p->ident_key = rb_str_buf_new(s - beg);
+    }
+    rb_str_set_len(key, 0);
+    rb_enc_associate(key, enc);
+    rb_str_cat(key, beg, s - beg);
+    ENC_CODERANGE_CLEAR(key);
+    value = rb_hash_lookup2(table, key, Qundef);
+    if (value != Qundef) return value;
+    return extract_range(p, p->prev, p->curr);
+}
+
+/* The comments #skip_trivia skips along with whitespace. */
+#define TRIVIA_MAX_DELIMITERS 4
+
+struct trivia_style {
+    int n_lines;
+    const char *line[TRIVIA_MAX_DELIMITERS];
+    long line_len[TRIVIA_MAX_DELIMITERS];
+    int n_blocks;
+    const char *open[TRIVIA_MAX_DELIMITERS], *close[TRIVIA_MAX_DELIMITERS];
+    long open_len[TRIVIA_MAX_DELIMITERS], close_len[TRIVIA_MAX_DELIMITERS];
+    /* whether "--" may open a Lua long comment, --[[ ... ]] */
+    int lua;
+};
+
+static const struct trivia_style trivia_c = {
+    1, {"//"}, {2}, 1, {"/*"}, {"*/"}, {2}, {2}, 0
+};
+static const struct trivia_style trivia_shell = {
+    1, {"#"}, {1}, 0, {NULL}, {NULL}, {0}, {0}, 0
+};
+static const struct trivia_style trivia_sql = {
+    1, {"--"}, {2}, 1, {"/*"}, {"*/"}, {2}, {2}, 0
+};
+static const struct trivia_style trivia_lua = {
+    1, {"--"}, {2}, 0, {NULL}, {NULL}, {0}, {0}, 1
+};
+
+/*
+ * Returns the bytes of a comment delimiter.  It must be a String already,
+ * as the pointer outlives the call: a converted temporary could be freed.
+ */
+static const char *
+trivia_delimiter(struct strscanner *p, VALUE delimiter, long *len)
+{
+    Check_Type(delimiter, T_STRING);
+    rb_enc_check(p->str, delimiter);
+    if (RSTRING_LEN(delimiter) == 0) {
+        rb_raise(rb_eArgError, "empty comment delimiter");
+    }
+    *len = RSTRING_LEN(delimiter);
+    return RSTRING_PTR(delimiter);
+}
+
+/*
+ * Fills +style+ from a Hash such as {line: "#", block: ["(*", "*)"]}.  The
+ * delimiters stay in +hash+, which the caller holds; nothing allocates
+ * once their pointers are taken, so GC can't move them meanwhile.
+ */
+static void
+trivia_style_from_hash(struct strscanner *p, VALUE hash,
+                       struct trivia_style *style)
+{
+    VALUE line, block;
+    long i;
+
+    memset(style, 0, sizeof(*style));
+    line = rb_hash_lookup(hash, ID2SYM(rb_intern("line")));
+    block = rb_hash_lookup(hash, ID2SYM(rb_intern("block")));
+    if (!NIL_P(line) && !RB_TYPE_P(line, T_ARRAY)) {
+        line = rb_ary_new_from_args(1, line);
+    }
+    if (!NIL_P(block)) {
+        Check_Type(block, T_ARRAY);
+        if (RARRAY_LEN(block) > 0 && !RB_TYPE_P(RARRAY_AREF(block, 0), T_ARRAY)) {
+            block = rb_ary_new_from_args(1, block);
+        }
+    }
+    if (!NIL_P(line)) {
+        if (RARRAY_LEN(line) > TRIVIA_MAX_DELIMITERS) {
+            rb_raise(rb_eArgError, "too many line comment delimiters (max %d)",
+                     TRIVIA_MAX_DELIMITERS);
+        }
+        for (i = 0; i < RARRAY_LEN(line); i++) {
+            style->line[i] = trivia_delimiter(p, RARRAY_AREF(line, i),
+                                              &style->line_len[i]);
+        }
+        style->n_lines = (int)RARRAY_LEN(line);
+    }
+    if (!NIL_P(block)) {
+        if (RARRAY_LEN(block) > TRIVIA_MAX_DELIMITERS) {
+            rb_raise(rb_eArgError, "too many block comment delimiters (max %d)",
+                     TRIVIA_MAX_DELIMITERS);
+        }
+        for (i = 0; i < RARRAY_LEN(block); i++) {
+            VALUE pair = RARRAY_AREF(block, i);
+            Check_Type(pair, T_ARRAY);
+            if (RARRAY_LEN(pair) != 2) {
+                rb_raise(rb_eArgError, "block comment delimiters must be [open, close]");
+            }
+            style->open[i] = trivia_delimiter(p, RARRAY_AREF(pair, 0),
+                                              &style->open_len[i]);
+            style->close[i] = trivia_delimiter(p, RARRAY_AREF(pair, 1),
+                                               &style->close_len[i]);
+        }
+        style->n_blocks = (int)RARRAY_LEN(block);
+    }
+    RB_GC_GUARD(line);
+    RB_GC_GUARD(block);
+}
+
+static long
+count_newlines(const char *s, const char *end)
+{
+    long n = 0;
+
+    while ((s = memchr(s, '\n', end - s)) != NULL) {
+        n++;
+        s++;
+    }
+    return n;
+}
+
+/* Returns the end of the first +close+ at or after +s+, or NULL. */
+static const char *
+trivia_block_end(struct strscanner *p, const char *s, const char *end,
+                 const char *close, long close_len)
+{
+    while (end - s >= close_len) {
+        s = memchr(s, close[0], end - s - close_len + 1);
+        if (!s) return NULL;
+        if (memcmp(s, close, close_len) == 0 && char_head_p(p, s)) {
+            return s + close_len;
+        }
+        s++;
+    }
+    return NULL;
+}
+
+/*
+ * Returns the end of the Lua long comment whose opening bracket is at +s+,
+ * just after its "--", or NULL if there isn't one or it's unterminated.
+ * Sets *unterminated in the latter case.
+ */
+static const char *
+lua_long_comment_end(struct strscanner *p, const char *s, const char *end,
+                     int *unterminated)
+{
+    const char *t = s + 1;
+    long level;
+
+    if (s >= end || *s != '[') return NULL;
+    while (t < end && *t == '=') t++;
+    if (t >= end || *t != '[') return NULL;
+    level = t - s - 1;
+    for (t++; (t = memchr(t, ']', end - t)) != NULL; t++) {
+        long i;
+
+        for (i = 1; i <= level && t + i < end && t[i] == '='; i++);
+        if (i == level + 1 && t + i < end && t[i] == ']' && char_head_p(p, t)) {
+            return t + i + 1;
+        }
+    }
+    *unterminated = 1;
+    return NULL;
+}
+
+/*
+ * Returns the end of the comment at +s+, or NULL if there's none or it's
+ * unterminated.  A line comment ends before its newline.
+ */
+static const char *
+trivia_comment_end(struct strscanner *p, const struct trivia_style *style,
+                   const char *s, const char *end)
+{
+    int i;
+
+    for (i = 0; i < style->n_blocks; i++) {
+        if (end - s >= style->open_len[i] && s[0] == style->open[i][0] &&
+            memcmp(s, style->open[i], style->open_len[i]) == 0) {
+            return trivia_block_end(p, s + style->open_len[i], end,
+                                    style->close[i], style->close_len[i]);
+        }
+    }
+    for (i = 0; i < style->n_lines; i++) {
+        if (end - s >= style->line_len[i] && s[0] == style->line[i][0] &&
+            memcmp(s, style->line[i], style->line_len[i]) == 0) {
+            const char *t = s + style->line_len[i];
+            if (style->lua) {
+                int unterminated = 0;
+                const char *u = lua_long_comment_end(p, t, end, &unterminated);
+                if (u) return u;
+                if (unterminated) return NULL;
+            }
+            t = memchr(t, '\n', end - t);
+            return t ? t : end;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * call-seq: skip_trivia(style = :c, newlines: false)
+ *
+ * Skips whitespace and comments at the scan pointer in one pass, as a
+ * loop over #skip with a Regexp for each would.  Returns the number of
+ * bytes skipped, or +nil+ if there's no whitespace or comment at the scan
+ * pointer.  With <tt>newlines: true</tt>, returns the number of newlines
+ * skipped instead, for keeping track of line numbers.
+ *
+ * +style+ is one of these, or a Hash with a <tt>:line</tt> comment
+ * delimiter and <tt>:block</tt> comment delimiters, or Arrays of them:
+ *
+ * [+:c+]     <tt>// ...</tt> and <tt>/\* ... *\/</tt>
+ * [+:shell+] <tt># ...</tt>
+ * [+:sql+]   <tt>-- ...</tt> and <tt>/\* ... *\/</tt>
+ * [+:lua+]   <tt>-- ...</tt> and <tt>--[[ ... ]]</tt>, <tt>--[==[ ... ]==]</tt>
+ *
+ * Block comment delimiters are tried before line comment ones, and block
+ * comments don't nest.  An unterminated block comment isn't skipped, so
+ * more of the string may be appended with #concat and the scan retried.
+ *
+ *   s = StringScanner.new("  // note\n  x = 1")
+ *   s.skip_trivia                   # -> 12
+ *   s.scan(/\w/)                    # -> "x"
+ *
+ *   s = StringScanner.new("# a\n\n{ b }")
+ *   s.skip_trivia(:shell, newlines: true)               # -> 2
+ *   s.skip_trivia({line: ";", block: ["{", "}"]})     # -> 5
+ */
+static VALUE
+strscan_skip_trivia(int argc, VALUE *argv, VALUE self)
 {
     struct strscanner *p;
-    long len;
-
+    struct trivia_style custom;
+    const struct trivia_style *style;
+    VALUE vstyle, options;
+    const char *beg, *s, *end;
+    long newlines = 0;
+    int count_lines = 0;
+
+    rb_scan_args(argc, argv, "01:", &vstyle, &options);
+    if (!NIL_P(options)) {
+        ID keyword_id = rb_intern("newlines");
+        VALUE value;
+        rb_get_kwargs(options, &keyword_id, 0, 1, &value);
+        count_lines = value != Qundef && RTEST(value);
+    }
     GET_SCANNER(self, p);
+    if (!rb_enc_asciicompat(rb_enc_get(p->str))) {
+        rb_raise(rb_eEncCompatError, "ASCII incompatible encoding: %s",
+                 rb_enc_name(rb_enc_get(p->str)));
+    }
+    if (NIL_P(vstyle) || vstyle == ID2SYM(rb_intern("c"))) {
+        style = &trivia_c;
+    }
+    else if (vstyle == ID2SYM(rb_intern("shell"))) {
+        style = &trivia_shell;
+    }
+    else if (vstyle == ID2SYM(rb_intern("sql"))) {
+        style = &trivia_sql;
+    }
+    else if (vstyle == ID2SYM(rb_intern("lua"))) {
+        style = &trivia_lua;
+    }
+    else if (RB_TYPE_P(vstyle, T_HASH)) {
+        trivia_style_from_hash(p, vstyle, &custom);
+        style = &custom;
+    }
+    else {
+        rb_raise(rb_eArgError, "unknown trivia style: %+"PRIsVALUE, vstyle);
+    }
+
     CLEAR_MATCH_STATUS(p);
-    if (EOS_P(p))
-        return Qnil;
+    if (S_RESTLEN(p) <= 0) return Qnil;
+    s = beg = CURPTR(p);
+    end = S_PEND(p);
+    for (;;) {
+        const char *t;
+
+        /* indentation, a word at a time */
+        while (end - s >= (long)sizeof(uint64_t)) {
+            uint64_t word;
+            memcpy(&word, s, sizeof(word));
+            if (word != WORD_LSB * ' ') break;
+            s += sizeof(word);
+        }
+        while (s < end && rb_isspace((unsigned char)*s)) {
+            if (*s == '\n') newlines++;
+            s++;
+        }
+        if (s >= end) break;
+        t = trivia_comment_end(p, style, s, end);
+        if (!t) break;
+        if (count_lines) newlines += count_newlines(s, t);
+        s = t;
+    }
+    if (s == beg) return Qnil;
 
-    len = rb_enc_mbclen(CURPTR(p), S_PEND(p), rb_enc_get(p->str));
-    len = minl(len, S_RESTLEN(p));
-    p->prev = p->curr;
-    p->curr += len;
+    set_registers(p, s - beg);
     MATCHED(p);
-    adjust_registers_to_matched(p);
-    return extract_range(p,
-                         adjust_register_position(p, p->regs.beg[0]),
-                         adjust_register_position(p, p->regs.end[0]));
+    p->prev = p->curr;
+    p->curr = s - S_PBEG(p);
+    return LONG2NUM(count_lines ? newlines : s - beg);
+}
+
+/* Where #tokenize writes its tokens. */
+struct token_buffer {
+    VALUE buffer;
+    /* an IO::Buffer is filled from its start; a String grows instead */
+    int io_buffer;
+};
+
+static void
+token_buffer_init(struct strscanner *p, struct token_buffer *tb, VALUE buffer)
+{
+    tb->buffer = buffer;
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_WRITING
+    if (rb_obj_is_kind_of(buffer, rb_cIOBuffer)) {
+        void *base;
+        size_t size;
+
+        /* only to raise early if it can't be written */
+        rb_io_buffer_get_bytes_for_writing(buffer, &base, &size);
+        tb->io_buffer = 1;
+        return;
+    }
+#endif
+    StringValue(buffer);
+    if (buffer == p->str) {
+        rb_raise(rb_eArgError, "can't write tokens into the scanned string");
+    }
+    rb_str_modify(buffer);
+    tb->io_buffer = 0;
+}
+
+/* Writes the +n+th token of this call, or returns 0 if the buffer is full. */
+static int
+token_buffer_push(struct token_buffer *tb, size_t n,
+                  const struct rb_strscan_token *token)
+{
+    long len;
+
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_WRITING
+    if (tb->io_buffer) {
+        void *base;
+        size_t size;
+
+        /* fetched for each token, as matching may switch to a thread
+           that resizes or frees the buffer */
+        rb_io_buffer_get_bytes_for_writing(tb->buffer, &base, &size);
+        if (n >= size / sizeof(*token)) return 0;
+        memcpy((char *)base + n * sizeof(*token), token, sizeof(*token));
+        return 1;
+    }
+#endif
+
+    len = RSTRING_LEN(tb->buffer);
+    if (rb_str_capacity(tb->buffer) - len < sizeof(*token)) {
+        /* double it, as appending to a String one token at a time would
+           only grow it by the token */
+        rb_str_modify_expand(tb->buffer, len < 64 * (long)sizeof(*token) ?
+                                         64 * (long)sizeof(*token) : len);
+    }
+    memcpy(RSTRING_PTR(tb->buffer) + len, token, sizeof(*token));
+    rb_str_set_len(tb->buffer, len + sizeof(*token));
+    return 1;
 }
 
 /*
- * Scans one byte and returns it.
- * This method is not multibyte character sensitive.
- * See also: #getch.
+ * Returns the length of the match of rule +pattern+ at the scan pointer,
+ * or -1.  A Regexp's captures are stored into +regs+ unless it's NULL.
+ */
+static long
+rule_match(struct strscanner *p, VALUE pattern, struct re_registers *regs)
+{
+    struct scan_regexp sr;
+    long target_offset, ret;
+
+    if (RB_TYPE_P(pattern, T_STRING)) {
+        long len = RSTRING_LEN(pattern);
+        if (S_RESTLEN(p) < len) return -1;
+        if (memcmp(CURPTR(p), RSTRING_PTR(pattern), len) != 0) return -1;
+        return len;
+    }
+
+    prepare_regexp(p, pattern, &sr);
+    target_offset = match_target_offset(p);
+    ret = regexp_exec(p, &sr,
+                      (UChar *)S_PBEG(p) + target_offset,
+                      (UChar *)S_PEND(p),
+                      (UChar *)CURPTR(p),
+                      NULL,
+                      regs,
+                      match_options(p, target_offset));
+    release_regexp(&sr);
+    if (regs && ret >= 0 && p->fixed_anchor_p && target_offset > 0) {
+        shift_registers(p, target_offset);
+    }
+    return ret;
+}
+
+/*
+ * call-seq: tokenize(rules, buffer) => Integer
  *
- *   s = StringScanner.new('ab')
- *   s.get_byte         # => "a"
- *   s.get_byte         # => "b"
- *   s.get_byte         # => nil
+ * Scans tokens at the scan pointer until none of +rules+, an Array of
+ * Strings and Regexps, matches, and writes them into +buffer+ instead of
+ * returning them.  The first rule that matches wins, as in a lexer; empty
+ * matches are ignored.  Returns the number of tokens written.
  *
- *   s = StringScanner.new("\244\242".force_encoding("euc-jp"))
- *   s.get_byte         # => "\xA4"
- *   s.get_byte         # => "\xA2"
- *   s.get_byte         # => nil
+ * Each token is a StringScanner::TOKEN_SIZE byte record of its byte offset
+ * in the string, its length in bytes and the index of its rule, packed
+ * as "QLL".  +buffer+ is a binary String the tokens are appended to, or
+ * an IO::Buffer that's filled from its start; tokenizing stops when it's
+ * full.  StringScanner.each_token reads them back.
+ *
+ * As with #scan_until_any, the last token is the last match and its rule
+ * is #matched_pattern_index; a Regexp rule's captures are kept for it.
+ *
+ *   RULES = [/\d+/, /\w+/, /\s+/, "+"]
+ *   s = StringScanner.new("sum + 42")
+ *   tokens = String.new
+ *   s.tokenize(RULES, tokens)        # -> 5
+ *   s.eos?                           # -> true
+ *   tokens.unpack("QLL" * 2)         # -> [0, 3, 1, 3, 1, 2]
  */
 static VALUE
-strscan_get_byte(VALUE self)
+strscan_tokenize(VALUE self, VALUE rules, VALUE buffer)
 {
     struct strscanner *p;
-
+    struct token_buffer tb;
+    struct rb_strscan_token token;
+    VALUE rule = Qnil, last_rule = Qnil;
+    uint32_t last_id = 0;
+    long i, len = -1;
+    size_t n = 0;
+
+    Check_Type(rules, T_ARRAY);
     GET_SCANNER(self, p);
+    for (i = 0; i < RARRAY_LEN(rules); i++) {
+        VALUE rule = RARRAY_AREF(rules, i);
+        if (RB_TYPE_P(rule, T_STRING)) {
+            rb_enc_check(p->str, rule);
+        }
+        else if (!RB_TYPE_P(rule, T_REGEXP)) {
+            rb_raise(rb_eTypeError,
+                     "wrong argument type %"PRIsVALUE" (expected String or Regexp)",
+                     rb_obj_class(rule));
+        }
+    }
+    token_buffer_init(p, &tb, buffer);
+
     CLEAR_MATCH_STATUS(p);
-    if (EOS_P(p))
-        return Qnil;
+    while (S_RESTLEN(p) > 0) {
+        for (i = 0; i < RARRAY_LEN(rules); i++) {
+            rule = RARRAY_AREF(rules, i);
+            len = rule_match(p, rule, NULL);
+            if (len > 0) break;
+        }
+        if (i == RARRAY_LEN(rules)) break;
+        if (len > UINT32_MAX) {
+            rb_raise(rb_eRangeError, "token too long: %ld bytes", len);
+        }
 
-    p->prev = p->curr;
-    p->curr++;
-    MATCHED(p);
-    adjust_registers_to_matched(p);
-    return extract_range(p,
-                         adjust_register_position(p, p->regs.beg[0]),
-                         adjust_register_position(p, p->regs.end[0]));
+        token.beg = p->curr;
+        token.len = (uint32_t)len;
+        token.id = (uint32_t)i;
+        if (!token_buffer_push(&tb, n, &token)) break;
+        n++;
+        last_rule = rule;
+        last_id = token.id;
+
+        set_registers(p, len);
+        p->prev = p->curr;
+        p->curr += len;
+    }
+    if (n > 0) {
+        long last_len = p->curr - p->prev;
+
+        if (RB_TYPE_P(last_rule, T_REGEXP) &&
+            onig_number_of_captures(RREGEXP_PTR(last_rule)) > 0) {
+            /* the loop skipped the captures; match it again for them */
+            p->curr = p->prev;
+            if (rule_match(p, last_rule, &p->regs) == last_len) {
+                CLEAR_INLINE_REGS(p);
+                p->regex = last_rule;
+            }
+            p->curr = p->prev + last_len;
+        }
+        MATCHED(p);
+        PATTERN_INDEX(p);
+        p->pattern_index = last_id;
+    }
+    return SIZET2NUM(n);
 }
 
 /*
- * Equivalent to #get_byte.
- * This method is obsolete; use #get_byte instead.
+ * call-seq:
+ *   StringScanner.each_token(buffer, count = nil) { |id, beg, end| ... }
+ *   StringScanner.each_token(buffer, count = nil) => Enumerator
+ *
+ * Yields the rule index, the start and the end of each token that
+ * #tokenize wrote into +buffer+, reading them one at a time.  +count+
+ * is the number of tokens to read; a String's are all read by default,
+ * while an IO::Buffer needs the count #tokenize returned.
+ *
+ *   s = StringScanner.new("sum + 42")
+ *   tokens = String.new
+ *   s.tokenize([/\d+/, /\w+/, /\s+/, "+"], tokens)
+ *   StringScanner.each_token(tokens).to_a
+ *   # -> [[1, 0, 3], [2, 3, 4], [3, 4, 5], [2, 5, 6], [0, 6, 8]]
  */
 static VALUE
-strscan_getbyte(VALUE self)
+strscan_s_each_token(int argc, VALUE *argv, VALUE klass)
 {
-    rb_warning("StringScanner#getbyte is obsolete; use #get_byte instead");
-    return strscan_get_byte(self);
+    VALUE buffer, vcount;
+    long i, count;
+
+    rb_scan_args(argc, argv, "11", &buffer, &vcount);
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_WRITING
+    if (rb_obj_is_kind_of(buffer, rb_cIOBuffer)) {
+        const void *base;
+        size_t size;
+
+        if (NIL_P(vcount)) {
+            rb_raise(rb_eArgError, "count is required for IO::Buffer");
+        }
+        rb_io_buffer_get_bytes_for_reading(buffer, &base, &size);
+        count = NUM2LONG(vcount);
+        if (count < 0 || (size_t)count > size / sizeof(struct rb_strscan_token)) {
+            rb_raise(rb_eArgError, "count out of range: %ld", count);
+        }
+    }
+    else
+#endif
+    {
+        StringValue(buffer);
+        count = NIL_P(vcount) ? -1 : NUM2LONG(vcount);
+        if (count < -1 ||
+            count > (long)(RSTRING_LEN(buffer) / sizeof(struct rb_strscan_token))) {
+            rb_raise(rb_eArgError, "count out of range: %ld", count);
+        }
+        if (count < 0) {
+            count = RSTRING_LEN(buffer) / sizeof(struct rb_strscan_token);
+        }
+    }
+    RETURN_ENUMERATOR(klass, argc, argv);
+
+    for (i = 0; i < count; i++) {
+        struct rb_strscan_token token;
+        const char *base;
+        size_t size;
+
+        /* the block may resize or free the buffer */
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_WRITING
+        if (rb_obj_is_kind_of(buffer, rb_cIOBuffer)) {
+            const void *ptr;
+            rb_io_buffer_get_bytes_for_reading(buffer, &ptr, &size);
+            base = ptr;
+        }
+        else
+#endif
+        {
+            base = RSTRING_PTR(buffer);
+            size = RSTRING_LEN(buffer);
+        }
+        if ((i + 1) * sizeof(token) > size) break;
+        memcpy(&token, base + i * sizeof(token), sizeof(token));
+        rb_yield_values(3, UINT2NUM(token.id), ULL2NUM(token.beg),
+                        ULL2NUM(token.beg + token.len));
+    }
+    return klass;
 }
 
 /*
@@ -959,6 +3946,101 @@ strscan_peep(VALUE self, VALUE vlen)
     return strscan_peek(self, vlen);
 }
 
+/*
+ * call-seq: peek_byte(offset = 0)
+ *
+ * Returns the byte +offset+ bytes after the scan pointer as an Integer,
+ * or +nil+ if the string ends before it, without advancing the scan
+ * pointer.
+ *
+ *   s = StringScanner.new('ab')
+ *   s.peek_byte      # => 97
+ *   s.peek_byte(1)   # => 98
+ *   s.peek_byte(2)   # => nil
+ */
+static VALUE
+strscan_peek_byte(int argc, VALUE *argv, VALUE self)
+{
+    struct strscanner *p;
+    VALUE voffset;
+    long offset = 0;
+
+    rb_scan_args(argc, argv, "01", &voffset);
+    if (!NIL_P(voffset)) {
+        offset = NUM2LONG(voffset);
+        if (offset < 0) rb_raise(rb_eArgError, "negative offset: %ld", offset);
+    }
+    GET_SCANNER(self, p);
+
+    if (offset >= S_RESTLEN(p)) return Qnil;
+    return INT2FIX((unsigned char)CURPTR(p)[offset]);
+}
+
+/*
+ * call-seq: peek_eq?(str)
+ *
+ * Returns whether the string continues with +str+ at the scan pointer.
+ * Same as <tt>peek(str.bytesize) == str</tt>, but without creating a
+ * String.  Neither the scan pointer nor the match data change.
+ *
+ *   s = StringScanner.new('--flag')
+ *   s.peek_eq?('--')   # => true
+ *   s.peek_eq?('-f')   # => false
+ */
+static VALUE
+strscan_peek_eq_p(VALUE self, VALUE str)
+{
+    struct strscanner *p;
+
+    StringValue(str);
+    GET_SCANNER(self, p);
+
+    rb_enc_check(p->str, str);
+    if (S_RESTLEN(p) < RSTRING_LEN(str)) return Qfalse;
+    return memcmp(CURPTR(p), RSTRING_PTR(str), RSTRING_LEN(str)) == 0 ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq: peek_in?(charset)
+ *
+ * Returns whether the character at the scan pointer is one of the
+ * characters of the String +charset+, without advancing the scan
+ * pointer.  Returns +false+ at the end of the string.
+ *
+ *   s = StringScanner.new('+1')
+ *   s.peek_in?('+-')    # => true
+ *   s.peek_in?('0123')  # => false
+ */
+static VALUE
+strscan_peek_in_p(VALUE self, VALUE charset)
+{
+    struct strscanner *p;
+    rb_encoding *enc;
+    const char *s, *end, *c, *set_end;
+    int len;
+
+    StringValue(charset);
+    GET_SCANNER(self, p);
+
+    enc = rb_enc_check(p->str, charset);
+    if (EOS_P(p)) return Qfalse;
+    s = CURPTR(p);
+    end = S_PEND(p);
+    c = RSTRING_PTR(charset);
+    set_end = RSTRING_END(charset);
+    if ((unsigned char)*s < 0x80 && rb_enc_str_asciionly_p(charset)) {
+        return memchr(c, *s, set_end - c) ? Qtrue : Qfalse;
+    }
+    len = rb_enc_mbclen(s, end, enc);
+    len = (int)minl(len, end - s);
+    while (c < set_end) {
+        int set_len = rb_enc_mbclen(c, set_end, enc);
+        if (set_len == len && memcmp(c, s, len) == 0) return Qtrue;
+        c += set_len;
+    }
+    return Qfalse;
+}
+
 /*
  * Sets the scan pointer to the previous position.  Only one previous position is
  * remembered, and it changes with each scanning operation.
@@ -1086,47 +4168,196 @@ strscan_matched(VALUE self)
     GET_SCANNER(self, p);
     if (! MATCHED_P(p)) return Qnil;
     return extract_range(p,
-                         adjust_register_position(p, p->regs.beg[0]),
-                         adjust_register_position(p, p->regs.end[0]));
+                         adjust_register_position(p, REG_BEG(p, 0)),
+                         adjust_register_position(p, REG_END(p, 0)));
+}
+
+/*
+ * Returns the size of the most recent match in bytes, or +nil+ if there
+ * was no recent match.  This is different than <tt>matched.size</tt>,
+ * which will return the size in characters.
+ *
+ *   s = StringScanner.new('test string')
+ *   s.check /\w+/           # -> "test"
+ *   s.matched_size          # -> 4
+ *   s.check /\d+/           # -> nil
+ *   s.matched_size          # -> nil
+ */
+static VALUE
+strscan_matched_size(VALUE self)
+{
+    struct strscanner *p;
+
+    GET_SCANNER(self, p);
+    if (! MATCHED_P(p)) return Qnil;
+    return LONG2NUM(REG_END(p, 0) - REG_BEG(p, 0));
+}
+
+static int
+name_to_backref_number(struct re_registers *regs, VALUE regexp, const char* name, const char* name_end, rb_encoding *enc)
+{
+    int num;
+
+    num = onig_name_to_backref_number(RREGEXP_PTR(regexp),
+	(const unsigned char* )name, (const unsigned char* )name_end, regs);
+    if (num >= 1) {
+	return num;
+    }
+    else {
+	rb_enc_raise(enc, rb_eIndexError, "undefined group name reference: %.*s",
+					  rb_long2int(name_end - name), name);
+    }
+
+    UNREACHABLE;
+}
+
+static inline int
+group_matched_p(struct strscanner *p, long i)
+{
+    if (i < 0)                 return 0;
+    if (i >= NUM_REGS(p))      return 0;
+    if (REG_BEG(p, i) == -1)   return 0;
+    return 1;
+}
+
+static VALUE
+extract_group(struct strscanner *p, long i)
+{
+    if (! group_matched_p(p, i)) return Qnil;
+
+    return extract_range(p,
+                         adjust_register_position(p, REG_BEG(p, i)),
+                         adjust_register_position(p, REG_END(p, i)));
+}
+
+struct named_groups_arg {
+    VALUE groups;
+    rb_encoding *enc;
+};
+
+static int
+named_groups_i(const OnigUChar *name, const OnigUChar *name_end,
+               int back_num, int *back_refs, OnigRegex RB_UNUSED_VAR(regex),
+               void *arg)
+{
+    struct named_groups_arg *data = arg;
+    VALUE key, refs;
+    int i;
+
+    key = rb_enc_str_new((const char *)name, name_end - name, data->enc);
+    if (back_num == 1) {
+        refs = INT2FIX(back_refs[0]);
+    }
+    else {
+        refs = rb_ary_new2(back_num);
+        for (i = 0; i < back_num; i++) {
+            rb_ary_push(refs, INT2FIX(back_refs[i]));
+        }
+        rb_obj_freeze(refs);
+    }
+    rb_ary_push(data->groups, rb_obj_freeze(key));
+    rb_ary_push(data->groups, refs);
+    return 0;
+}
+
+/*
+ * Returns the named groups of the last used regexp as a flat array of
+ * name and back reference pairs.  A back reference is an Integer, or an
+ * Array of Integers when the name is used more than once.  The array is
+ * built once per regexp and cached, so the names are not resolved again
+ * on each match.
+ */
+static VALUE
+named_groups(struct strscanner *p)
+{
+    struct named_groups_arg data;
+
+    if (p->named_groups_regex == p->regex) return p->named_groups;
+
+    data.groups = rb_ary_new();
+    data.enc = rb_enc_get(p->regex);
+    onig_foreach_name(RREGEXP_PTR(p->regex), named_groups_i, &data);
+    rb_obj_freeze(data.groups);
+    p->named_groups_regex = p->regex;
+    p->named_groups = data.groups;
+    p->named_groups_struct = Qnil;
+    p->named_groups_members = Qnil;
+    return data.groups;
 }
 
 /*
- * Returns the size of the most recent match in bytes, or +nil+ if there
- * was no recent match.  This is different than <tt>matched.size</tt>,
- * which will return the size in characters.
- *
- *   s = StringScanner.new('test string')
- *   s.check /\w+/           # -> "test"
- *   s.matched_size          # -> 4
- *   s.check /\d+/           # -> nil
- *   s.matched_size          # -> nil
+ * Returns the back references of the last used regexp for each member
+ * of the +klass+ Struct, or +nil+ for members that aren't a group name.
+ * Cached like named_groups().
  */
 static VALUE
-strscan_matched_size(VALUE self)
+named_groups_members(struct strscanner *p, VALUE klass)
 {
-    struct strscanner *p;
-
-    GET_SCANNER(self, p);
-    if (! MATCHED_P(p)) return Qnil;
-    return LONG2NUM(p->regs.end[0] - p->regs.beg[0]);
+    VALUE groups, members, refs_list;
+    long i, j;
+
+    groups = named_groups(p);
+    if (p->named_groups_struct == klass) return p->named_groups_members;
+
+    members = rb_struct_s_members(klass);
+    refs_list = rb_ary_new2(RARRAY_LEN(members));
+    for (i = 0; i < RARRAY_LEN(members); i++) {
+        VALUE name = rb_sym2str(RARRAY_AREF(members, i));
+        VALUE refs = Qnil;
+        for (j = 0; j < RARRAY_LEN(groups); j += 2) {
+            if (RTEST(rb_str_equal(name, RARRAY_AREF(groups, j)))) {
+                refs = RARRAY_AREF(groups, j + 1);
+                break;
+            }
+        }
+        rb_ary_push(refs_list, refs);
+    }
+    rb_obj_freeze(refs_list);
+    p->named_groups_struct = klass;
+    p->named_groups_members = refs_list;
+    return refs_list;
 }
 
-static int
-name_to_backref_number(struct re_registers *regs, VALUE regexp, const char* name, const char* name_end, rb_encoding *enc)
+/*
+ * Returns the group number for +idx+ (an Integer, a String or a Symbol)
+ * in the last match, or a negative number if there is no such group.
+ */
+static long
+group_number(struct strscanner *p, VALUE idx)
 {
-    int num;
+    const char *name;
+    long i;
 
-    num = onig_name_to_backref_number(RREGEXP_PTR(regexp),
-	(const unsigned char* )name, (const unsigned char* )name_end, regs);
-    if (num >= 1) {
-	return num;
-    }
-    else {
-	rb_enc_raise(enc, rb_eIndexError, "undefined group name reference: %.*s",
-					  rb_long2int(name_end - name), name);
+    switch (TYPE(idx)) {
+        case T_SYMBOL:
+            idx = rb_sym2str(idx);
+            /* fall through */
+        case T_STRING:
+            if (!RTEST(p->regex)) return -1;
+            RSTRING_GETMEM(idx, name, i);
+            return name_to_backref_number(REGS_OR_NULL(p), p->regex, name, name + i, rb_enc_get(idx));
+        default:
+            i = NUM2LONG(idx);
     }
 
-    UNREACHABLE;
+    if (i < 0)
+        i += NUM_REGS(p);
+    return i;
+}
+
+/* Same as onig_name_to_backref_number(): the last matched group wins. */
+static VALUE
+extract_named_group(struct strscanner *p, VALUE refs)
+{
+    long i, ref;
+
+    if (FIXNUM_P(refs)) return extract_group(p, FIX2LONG(refs));
+
+    for (i = RARRAY_LEN(refs) - 1; i > 0; i--) {
+        ref = FIX2LONG(RARRAY_AREF(refs, i));
+        if (group_matched_p(p, ref)) break;
+    }
+    return extract_group(p, FIX2LONG(RARRAY_AREF(refs, i)));
 }
 
 /*
@@ -1158,35 +4389,12 @@ name_to_backref_number(struct re_registers *regs, VALUE regexp, const char* name
 static VALUE
 strscan_aref(VALUE self, VALUE idx)
 {
-    const char *name;
     struct strscanner *p;
-    long i;
 
     GET_SCANNER(self, p);
     if (! MATCHED_P(p))        return Qnil;
 
-    switch (TYPE(idx)) {
-        case T_SYMBOL:
-            idx = rb_sym2str(idx);
-            /* fall through */
-        case T_STRING:
-            if (!RTEST(p->regex)) return Qnil;
-            RSTRING_GETMEM(idx, name, i);
-            i = name_to_backref_number(&(p->regs), p->regex, name, name + i, rb_enc_get(idx));
-            break;
-        default:
-            i = NUM2LONG(idx);
-    }
-
-    if (i < 0)
-        i += p->regs.num_regs;
-    if (i < 0)                 return Qnil;
-    if (i >= p->regs.num_regs) return Qnil;
-    if (p->regs.beg[i] == -1)  return Qnil;
-
-    return extract_range(p,
-                         adjust_register_position(p, p->regs.beg[i]),
-                         adjust_register_position(p, p->regs.end[i]));
+    return extract_group(p, group_number(p, idx));
 }
 
 /*
@@ -1206,7 +4414,7 @@ strscan_size(VALUE self)
 
     GET_SCANNER(self, p);
     if (! MATCHED_P(p))        return Qnil;
-    return INT2FIX(p->regs.num_regs);
+    return INT2FIX(NUM_REGS(p));
 }
 
 /*
@@ -1231,13 +4439,13 @@ strscan_captures(VALUE self)
     GET_SCANNER(self, p);
     if (! MATCHED_P(p))        return Qnil;
 
-    num_regs = p->regs.num_regs;
+    num_regs = NUM_REGS(p);
     new_ary  = rb_ary_new2(num_regs);
 
     for (i = 1; i < num_regs; i++) {
         VALUE str = extract_range(p,
-                                  adjust_register_position(p, p->regs.beg[i]),
-                                  adjust_register_position(p, p->regs.end[i]));
+                                  adjust_register_position(p, REG_BEG(p, i)),
+                                  adjust_register_position(p, REG_END(p, i)));
         rb_ary_push(new_ary, str);
     }
 
@@ -1270,12 +4478,378 @@ strscan_values_at(int argc, VALUE *argv, VALUE self)
 
     new_ary = rb_ary_new2(argc);
     for (i = 0; i<argc; i++) {
-        rb_ary_push(new_ary, strscan_aref(self, argv[i]));
+        rb_ary_push(new_ary, extract_group(p, group_number(p, argv[i])));
     }
 
     return new_ary;
 }
 
+enum strscan_extract_mode {
+    EXTRACT_STRING,
+    EXTRACT_SHARED,
+    EXTRACT_SPAN
+};
+
+static enum strscan_extract_mode
+extract_mode_value(VALUE mode)
+{
+    if (mode == Qundef || NIL_P(mode) || mode == ID2SYM(rb_intern("string"))) {
+        return EXTRACT_STRING;
+    }
+    if (mode == ID2SYM(rb_intern("shared"))) return EXTRACT_SHARED;
+    if (mode == ID2SYM(rb_intern("span"))) return EXTRACT_SPAN;
+    rb_raise(rb_eArgError,
+             "invalid mode: %+"PRIsVALUE" (expected :string, :shared or :span)",
+             mode);
+
+    UNREACHABLE;
+}
+
+static enum strscan_extract_mode
+extract_mode(VALUE options)
+{
+    VALUE mode;
+    ID keyword_ids[1];
+
+    if (NIL_P(options)) return EXTRACT_STRING;
+
+    keyword_ids[0] = rb_intern("mode");
+    rb_get_kwargs(options, keyword_ids, 0, 1, &mode);
+    return extract_mode_value(mode);
+}
+
+/*
+ * Stores the i-th group of the last match into +ary+ at +n+ and returns
+ * the index to store the next group at.
+ */
+static long
+store_group(struct strscanner *p, VALUE ary, long n, long i,
+            enum strscan_extract_mode mode)
+{
+    long beg_i, end_i;
+
+    if (mode == EXTRACT_STRING) {
+        rb_ary_store(ary, n, extract_group(p, i));
+        return n + 1;
+    }
+
+    if (! group_matched_p(p, i)) {
+        rb_ary_store(ary, n++, Qnil);
+        if (mode == EXTRACT_SPAN) rb_ary_store(ary, n++, Qnil);
+        return n;
+    }
+    beg_i = adjust_register_position(p, REG_BEG(p, i));
+    end_i = adjust_register_position(p, REG_END(p, i));
+    if (mode == EXTRACT_SPAN) {
+        rb_ary_store(ary, n++, LONG2NUM(beg_i));
+        rb_ary_store(ary, n++, LONG2NUM(end_i));
+        return n;
+    }
+    if (beg_i > S_LEN(p)) {
+        rb_ary_store(ary, n, Qnil);
+    }
+    else {
+        end_i = minl(end_i, S_LEN(p));
+        rb_ary_store(ary, n, rb_str_subseq(p->str, beg_i, end_i - beg_i));
+    }
+    return n + 1;
+}
+
+/*
+ * call-seq:
+ *    captures_into(ary, mode: :string)   -> ary
+ *
+ * Same as #captures, but overwrites the caller-owned +ary+ instead of
+ * allocating a new array.  Unmatched subgroups are +nil+.  If nothing
+ * was priorly matched, +ary+ is cleared and +nil+ is returned.
+ *
+ * +mode+ selects what is stored for each subgroup:
+ *
+ * [+:string+] a new string (the default).
+ * [+:shared+] a substring sharing the buffer of the scanned string when
+ *             possible.  Cheaper for long subgroups.
+ * [+:span+]   the begin and end byte positions of the subgroup, as two
+ *             consecutive elements.  No string is allocated.
+ *
+ *   ary = []
+ *   s = StringScanner.new("Fri Dec 12 1975 14:39")
+ *   s.scan(/(\w+) (\w+) (\d+) /)             # -> "Fri Dec 12 "
+ *   s.captures_into(ary)                     # -> ["Fri", "Dec", "12"]
+ *   s.captures_into(ary, mode: :span)        # -> [0, 3, 4, 7, 8, 10]
+ */
+static VALUE
+strscan_captures_into(int argc, VALUE *argv, VALUE self)
+{
+    struct strscanner *p;
+    VALUE ary, options;
+    enum strscan_extract_mode mode;
+    long i, n;
+
+    rb_scan_args(argc, argv, "1:", &ary, &options);
+    Check_Type(ary, T_ARRAY);
+    mode = extract_mode(options);
+    GET_SCANNER(self, p);
+    if (! MATCHED_P(p)) {
+        rb_ary_clear(ary);
+        return Qnil;
+    }
+
+    n = 0;
+    for (i = 1; i < NUM_REGS(p); i++) {
+        n = store_group(p, ary, n, i, mode);
+    }
+    rb_ary_resize(ary, n);
+
+    return ary;
+}
+
+/*
+ * call-seq:
+ *    values_at_into(ary, i1, i2, ... iN, mode: :string)   -> ary
+ *
+ * Same as #values_at, but overwrites the caller-owned +ary+ instead of
+ * allocating a new array.  See #captures_into for +mode+.
+ *
+ *   ary = []
+ *   s = StringScanner.new("Fri Dec 12 1975 14:39")
+ *   s.scan(/(\w+) (\w+) (\d+) /)            # -> "Fri Dec 12 "
+ *   s.values_at_into(ary, 0, -1, 5, 2)      # -> ["Fri Dec 12 ", "12", nil, "Dec"]
+ */
+static VALUE
+strscan_values_at_into(int argc, VALUE *argv, VALUE self)
+{
+    struct strscanner *p;
+    VALUE ary, options = Qnil;
+    enum strscan_extract_mode mode;
+    long i, n;
+
+    rb_check_arity(argc, 1, UNLIMITED_ARGUMENTS);
+    if (argc > 1 && RB_TYPE_P(argv[argc - 1], T_HASH)) {
+        options = argv[--argc];
+    }
+    ary = argv[0];
+    Check_Type(ary, T_ARRAY);
+    mode = extract_mode(options);
+    GET_SCANNER(self, p);
+    if (! MATCHED_P(p)) {
+        rb_ary_clear(ary);
+        return Qnil;
+    }
+
+    n = 0;
+    for (i = 1; i < argc; i++) {
+        n = store_group(p, ary, n, group_number(p, argv[i]), mode);
+    }
+    rb_ary_resize(ary, n);
+
+    return ary;
+}
+
+static void
+push_field(struct strscanner *p, VALUE fields, const char *beg, const char *end,
+           enum strscan_extract_mode mode)
+{
+    long beg_i = beg - S_PBEG(p);
+
+    switch (mode) {
+      case EXTRACT_STRING:
+        rb_ary_push(fields, str_new(p, beg, end - beg));
+        break;
+      case EXTRACT_SHARED:
+        rb_ary_push(fields, rb_str_subseq(p->str, beg_i, end - beg));
+        break;
+      case EXTRACT_SPAN:
+        rb_ary_push(fields, LONG2NUM(beg_i));
+        rb_ary_push(fields, LONG2NUM(end - S_PBEG(p)));
+        break;
+    }
+}
+
+/*
+ * call-seq:
+ *    scan_fields(sep: ",", eol: "\n", quote: '"', mode: :string)   -> array
+ *
+ * Scans one record of delimited fields, such as a CSV or TSV line, and
+ * returns its fields.  The record ends at +eol+, which is consumed, or
+ * at the end of the string.  A record always has at least one field.
+ * The match register is set to the whole record.
+ *
+ * A field starting with +quote+ extends to the matching closing quote
+ * and may contain +sep+ and +eol+.  A doubled quote in it stands for one
+ * quote.  Set +quote+ to +nil+ to disable quoting.  If +eol+ is
+ * <tt>"\n"</tt>, a <tt>"\r"</tt> before it is removed from the last
+ * field.
+ *
+ * Returns +nil+ at the end of the string, and also when a quoted field
+ * isn't closed yet, so that more data can be appended with #concat and
+ * the record scanned again.  See #captures_into for +mode+; spans of
+ * quoted fields exclude the quotes and are not unescaped.
+ *
+ * Separators, end of lines and quotes are searched for a word at a time.
+ *
+ *   s = StringScanner.new("a,b\n\"c,\"\"d\"\"\",\n")
+ *   s.scan_fields       # -> ["a", "b"]
+ *   s.scan_fields       # -> ["c,\"d\"", ""]
+ *   s.scan_fields       # -> nil
+ */
+static VALUE
+strscan_scan_fields(int argc, VALUE *argv, VALUE self)
+{
+    struct strscanner *p;
+    VALUE options, fields;
+    enum strscan_extract_mode mode = EXTRACT_STRING;
+    int sep = ',', eol = '\n', quote = '"';
+    unsigned char delimiters[2], quote_byte;
+    const char *s, *end, *field, *field_end;
+
+    rb_scan_args(argc, argv, "0:", &options);
+    if (!NIL_P(options)) {
+        ID keyword_ids[4];
+        VALUE values[4];
+        keyword_ids[0] = rb_intern("sep");
+        keyword_ids[1] = rb_intern("eol");
+        keyword_ids[2] = rb_intern("quote");
+        keyword_ids[3] = rb_intern("mode");
+        rb_get_kwargs(options, keyword_ids, 0, 4, values);
+        if (values[0] != Qundef) sep = ascii_byte_option(values[0], "sep");
+        if (values[1] != Qundef) eol = ascii_byte_option(values[1], "eol");
+        if (values[2] != Qundef) {
+            quote = NIL_P(values[2]) ? -1 : ascii_byte_option(values[2], "quote");
+        }
+        if (values[3] != Qundef) mode = extract_mode_value(values[3]);
+        if (sep == eol || sep == quote || eol == quote) {
+            rb_raise(rb_eArgError, "sep, eol and quote must be different");
+        }
+    }
+    GET_SCANNER(self, p);
+
+    CLEAR_MATCH_STATUS(p);
+    if (S_RESTLEN(p) <= 0) return Qnil;
+
+    delimiters[0] = sep;
+    delimiters[1] = eol;
+    quote_byte = quote;
+    fields = rb_ary_new();
+    s = CURPTR(p);
+    end = S_PEND(p);
+    for (;;) {
+        if (quote >= 0 && s < end && (unsigned char)*s == quote) {
+            VALUE value = Qnil;
+            const char *segment;
+
+            field = segment = s + 1;
+            for (s = field;; s += 2) {
+                s = search_ascii_bytes(p, s, end, &quote_byte, 1);
+                if (s == end) return Qnil;
+                if (s + 1 == end || (unsigned char)s[1] != quote) break;
+                /* doubled quote */
+                if (mode != EXTRACT_SPAN) {
+                    if (NIL_P(value)) value = str_new(p, "", 0);
+                    rb_str_cat(value, segment, s + 1 - segment);
+                    segment = s + 2;
+                }
+            }
+            field_end = s++;
+            if (NIL_P(value)) {
+                push_field(p, fields, field, field_end, mode);
+            }
+            else {
+                rb_str_cat(value, segment, field_end - segment);
+                ENC_CODERANGE_CLEAR(value);
+                rb_ary_push(fields, value);
+            }
+            /* ignore anything between the closing quote and the delimiter */
+            s = search_ascii_bytes(p, s, end, delimiters, 2);
+        }
+        else {
+            field = s;
+            s = field_end = search_ascii_bytes(p, s, end, delimiters, 2);
+            if (eol == '\n' && s < end && field_end > field && field_end[-1] == '\r') {
+                field_end--;
+            }
+            push_field(p, fields, field, field_end, mode);
+        }
+        if (s == end) break;
+        if ((unsigned char)*s++ == eol) break;
+    }
+
+    set_registers(p, s - CURPTR(p));
+    MATCHED(p);
+    p->prev = p->curr;
+    succ(p);
+    return fields;
+}
+
+/*
+ * call-seq: named_captures
+ *
+ * Returns a hash of the named subgroups in the most recent match.
+ * Each value is +nil+ if nothing was priorly matched.
+ *
+ *   s = StringScanner.new("Fri Dec 12 1975 14:39")
+ *   s.scan(/(?<wday>\w+) (?<month>\w+) (?<day>\d+) /)
+ *   s.named_captures     # -> {"wday"=>"Fri", "month"=>"Dec", "day"=>"12"}
+ */
+static VALUE
+strscan_named_captures(VALUE self)
+{
+    struct strscanner *p;
+    VALUE groups, captures;
+    long i;
+
+    GET_SCANNER(self, p);
+    captures = rb_hash_new();
+    if (NIL_P(p->regex)) return captures;
+
+    groups = named_groups(p);
+    for (i = 0; i < RARRAY_LEN(groups); i += 2) {
+        VALUE value = Qnil;
+        if (MATCHED_P(p)) {
+            value = extract_named_group(p, RARRAY_AREF(groups, i + 1));
+        }
+        rb_hash_aset(captures, RARRAY_AREF(groups, i), value);
+    }
+    return captures;
+}
+
+/*
+ * call-seq: named_captures_into(struct)
+ *
+ * Stores the named subgroups in the most recent match into the members
+ * of +struct+ with the same names, and returns +struct+.  Members that
+ * aren't a group name are left untouched.  The mapping from members to
+ * groups is cached, so this is cheaper than reading each group with #[].
+ *
+ *   Date = Struct.new(:wday, :month, :day)
+ *   date = Date.new
+ *   s = StringScanner.new("Fri Dec 12 1975 14:39")
+ *   s.scan(/(?<wday>\w+) (?<month>\w+) (?<day>\d+) /)
+ *   s.named_captures_into(date)  # -> #<struct Date wday="Fri", month="Dec", day="12">
+ */
+static VALUE
+strscan_named_captures_into(VALUE self, VALUE st)
+{
+    struct strscanner *p;
+    VALUE refs_list;
+    long i;
+
+    GET_SCANNER(self, p);
+    if (!rb_obj_is_kind_of(st, rb_cStruct)) {
+        rb_raise(rb_eTypeError, "wrong argument type %"PRIsVALUE" (expected Struct)",
+                 rb_obj_class(st));
+    }
+    if (NIL_P(p->regex)) return st;
+
+    refs_list = named_groups_members(p, rb_obj_class(st));
+    for (i = 0; i < RARRAY_LEN(refs_list); i++) {
+        VALUE refs = RARRAY_AREF(refs_list, i);
+        if (NIL_P(refs)) continue;
+        RSTRUCT_SET(st, (int)i,
+                    MATCHED_P(p) ? extract_named_group(p, refs) : Qnil);
+    }
+    return st;
+}
+
 /*
  * Returns the <i><b>pre</b>-match</i> (in the regular expression sense) of the last scan.
  *
@@ -1294,7 +4868,7 @@ strscan_pre_match(VALUE self)
     if (! MATCHED_P(p)) return Qnil;
     return extract_range(p,
                          0,
-                         adjust_register_position(p, p->regs.beg[0]));
+                         adjust_register_position(p, REG_BEG(p, 0)));
 }
 
 /*
@@ -1314,7 +4888,7 @@ strscan_post_match(VALUE self)
     GET_SCANNER(self, p);
     if (! MATCHED_P(p)) return Qnil;
     return extract_range(p,
-                         adjust_register_position(p, p->regs.end[0]),
+                         adjust_register_position(p, REG_END(p, 0)),
                          S_LEN(p));
 }
 
@@ -1461,6 +5035,125 @@ strscan_fixed_anchor_p(VALUE self)
     return p->fixed_anchor_p ? Qtrue : Qfalse;
 }
 
+/*
+ * call-seq:
+ *    scanner.lookbehind_window -> integer or nil
+ *
+ * How many bytes before the scan pointer regexps may look at in fixed
+ * anchor mode, or +nil+ if they see the whole string.  See
+ * StringScanner.new.
+ */
+static VALUE
+strscan_lookbehind_window(VALUE self)
+{
+    struct strscanner *p;
+    p = check_strscan(self);
+    if (p->lookbehind_window < 0) return Qnil;
+    return LONG2NUM(p->lookbehind_window);
+}
+
+/*
+ * call-seq:
+ *    scanner.timeout -> float or nil
+ *
+ * How many seconds a single regexp match may take before it raises
+ * StringScanner::MatchLimitError, or +nil+ if Regexp.timeout applies.
+ * See StringScanner.new.
+ */
+static VALUE
+strscan_timeout(VALUE self)
+{
+    struct strscanner *p;
+    p = check_strscan(self);
+    if (!p->timelimit) return Qnil;
+    return DBL2NUM(p->timelimit / 1e9);
+}
+
+/*
+ * call-seq:
+ *    scanner.regexp_cache_stats -> hash
+ *
+ * Returns the counters of the scanner's cache of regexps compiled again
+ * for the encoding of its string, which happens when a Regexp's own
+ * encoding doesn't suit it, such as an ASCII-only Regexp and a
+ * Shift_JIS string.  +:hits+ is the number of such compilations the
+ * cache saved, +:misses+ the number made, and +:size+ the number of
+ * regexps cached, at most 8.
+ *
+ *   s = StringScanner.new("caf\xE9 au lait".force_encoding("ISO-8859-1"))
+ *   s.skip(/\w+/)
+ *   s.skip(/\w+/)
+ *   s.regexp_cache_stats   # -> {:hits=>1, :misses=>1, :size=>1}
+ */
+static VALUE
+strscan_regexp_cache_stats(VALUE self)
+{
+    struct strscanner *p;
+    VALUE stats;
+
+    p = check_strscan(self);
+    stats = rb_hash_new();
+    rb_hash_aset(stats, ID2SYM(rb_intern("hits")), ULONG2NUM(p->regexp_cache_hits));
+    rb_hash_aset(stats, ID2SYM(rb_intern("misses")), ULONG2NUM(p->regexp_cache_misses));
+    rb_hash_aset(stats, ID2SYM(rb_intern("size")), INT2FIX(p->n_regexp_cache));
+    return stats;
+}
+
+/* =======================================================================
+                                 C API
+   ======================================================================= */
+
+long
+rb_strscan_match(VALUE scanner, VALUE pattern, int flags)
+{
+    VALUE length;
+
+    switch (flags & (RB_STRSCAN_ADVANCE | RB_STRSCAN_SEARCH)) {
+      case 0:
+        length = strscan_do_scan(scanner, pattern, 0, 0, 1, 0);
+        break;
+      case RB_STRSCAN_ADVANCE:
+        length = strscan_do_scan(scanner, pattern, 1, 0, 1, 0);
+        break;
+      case RB_STRSCAN_SEARCH:
+        length = strscan_do_scan(scanner, pattern, 0, 0, 0, 0);
+        break;
+      default:
+        length = strscan_do_scan(scanner, pattern, 1, 0, 0, 0);
+        break;
+    }
+    if (NIL_P(length)) return -1;
+    return FIX2LONG(length);
+}
+
+VALUE
+rb_strscan_string(VALUE scanner)
+{
+    return strscan_get_string(scanner);
+}
+
+long
+rb_strscan_pos(VALUE scanner)
+{
+    struct strscanner *p;
+
+    GET_SCANNER(scanner, p);
+    return p->curr;
+}
+
+int
+rb_strscan_span(VALUE scanner, long i, long *beg, long *end)
+{
+    struct strscanner *p;
+
+    GET_SCANNER(scanner, p);
+    if (! MATCHED_P(p)) return 0;
+    if (! group_matched_p(p, i)) return 0;
+    *beg = adjust_register_position(p, REG_BEG(p, i));
+    *end = adjust_register_position(p, REG_END(p, i));
+    return 1;
+}
+
 /* =======================================================================
                               Ruby Interface
    ======================================================================= */
@@ -1522,10 +5215,24 @@ strscan_fixed_anchor_p(VALUE self)
  *
  * - #getch
  * - #get_byte
+ * - #scan_u8
+ * - #scan_u16
+ * - #scan_u32
+ * - #scan_u64
+ * - #scan_varint
+ * - #scan_length_prefixed
+ * - #scan_chars
+ * - #skip_chars
+ * - #scan_quoted
+ * - #scan_fields
+ * - #scan_ident_in
+ * - #skip_trivia
+ * - #tokenize
  * - #scan
  * - #scan_until
  * - #skip
  * - #skip_until
+ * - #scan_until_any
  *
  * === Looking Ahead
  *
@@ -1534,6 +5241,15 @@ strscan_fixed_anchor_p(VALUE self)
  * - #exist?
  * - #match?
  * - #peek
+ * - #peek_byte
+ * - #peek_eq?
+ * - #peek_in?
+ *
+ * === Scanning Backward
+ *
+ * - #scan_backward
+ * - #skip_backward_until
+ * - #rcheck
  *
  * === Finding Where we Are
  *
@@ -1542,21 +5258,32 @@ strscan_fixed_anchor_p(VALUE self)
  * - #rest?
  * - #rest_size
  * - #pos
+ * - #limit
  *
  * === Setting Where we Are
  *
  * - #reset
+ * - #reset_with
  * - #terminate
  * - #pos=
+ * - #limit=
+ * - #with_limit
+ * - #replace
+ * - #checkpoint
  *
  * === Match Data
  *
  * - #matched
  * - #matched?
  * - #matched_size
+ * - #matched_pattern_index
  * - []
  * - #pre_match
  * - #post_match
+ * - #captures_into
+ * - #values_at_into
+ * - #named_captures
+ * - #named_captures_into
  *
  * === Miscellaneous
  *
@@ -1586,18 +5313,29 @@ Init_strscan(void)
     if (!rb_const_defined(rb_cObject, id_scanerr)) {
 	rb_const_set(rb_cObject, id_scanerr, ScanError);
     }
+    MatchLimitError = rb_define_class_under(StringScanner, "MatchLimitError", ScanError);
+    if (rb_const_defined(rb_cRegexp, rb_intern("TimeoutError"))) {
+        RegexpTimeoutError = rb_const_get(rb_cRegexp, rb_intern("TimeoutError"));
+        rb_gc_register_mark_object(RegexpTimeoutError);
+    }
     tmp = rb_str_new2(STRSCAN_VERSION);
     rb_obj_freeze(tmp);
     rb_const_set(StringScanner, rb_intern("Version"), tmp);
     tmp = rb_str_new2("$Id$");
     rb_obj_freeze(tmp);
     rb_const_set(StringScanner, rb_intern("Id"), tmp);
+    rb_define_const(StringScanner, "TOKEN_SIZE",
+                    INT2FIX(sizeof(struct rb_strscan_token)));
+    rb_define_const(StringScanner, "C_API_VERSION",
+                    INT2FIX(RB_STRSCAN_API_VERSION));
 
     rb_define_alloc_func(StringScanner, strscan_s_allocate);
     rb_define_private_method(StringScanner, "initialize", strscan_initialize, -1);
     rb_define_private_method(StringScanner, "initialize_copy", strscan_init_copy, 1);
     rb_define_singleton_method(StringScanner, "must_C_version", strscan_s_mustc, 0);
+    rb_define_singleton_method(StringScanner, "each_token", strscan_s_each_token, -1);
     rb_define_method(StringScanner, "reset",       strscan_reset,       0);
+    rb_define_method(StringScanner, "reset_with",  strscan_reset_with, -1);
     rb_define_method(StringScanner, "terminate",   strscan_terminate,   0);
     rb_define_method(StringScanner, "clear",       strscan_clear,       0);
     rb_define_method(StringScanner, "string",      strscan_get_string,  0);
@@ -1609,24 +5347,52 @@ Init_strscan(void)
     rb_define_method(StringScanner, "charpos",     strscan_get_charpos, 0);
     rb_define_method(StringScanner, "pointer",     strscan_get_pos,     0);
     rb_define_method(StringScanner, "pointer=",    strscan_set_pos,     1);
-
-    rb_define_method(StringScanner, "scan",        strscan_scan,        1);
-    rb_define_method(StringScanner, "skip",        strscan_skip,        1);
-    rb_define_method(StringScanner, "match?",      strscan_match_p,     1);
-    rb_define_method(StringScanner, "check",       strscan_check,       1);
+    rb_define_method(StringScanner, "limit",       strscan_get_limit,   0);
+    rb_define_method(StringScanner, "limit=",      strscan_set_limit,   1);
+    rb_define_method(StringScanner, "with_limit",  strscan_with_limit,  1);
+
+    rb_define_method(StringScanner, "scan",        strscan_scan,       -1);
+    rb_define_method(StringScanner, "skip",        strscan_skip,       -1);
+    rb_define_method(StringScanner, "match?",      strscan_match_p,    -1);
+    rb_define_method(StringScanner, "check",       strscan_check,      -1);
     rb_define_method(StringScanner, "scan_full",   strscan_scan_full,   3);
 
-    rb_define_method(StringScanner, "scan_until",  strscan_scan_until,  1);
-    rb_define_method(StringScanner, "skip_until",  strscan_skip_until,  1);
-    rb_define_method(StringScanner, "exist?",      strscan_exist_p,     1);
-    rb_define_method(StringScanner, "check_until", strscan_check_until, 1);
+    rb_define_method(StringScanner, "scan_until",  strscan_scan_until, -1);
+    rb_define_method(StringScanner, "skip_until",  strscan_skip_until, -1);
+    rb_define_method(StringScanner, "exist?",      strscan_exist_p,    -1);
+    rb_define_method(StringScanner, "check_until", strscan_check_until,-1);
     rb_define_method(StringScanner, "search_full", strscan_search_full, 3);
+    rb_define_method(StringScanner, "scan_until_any", strscan_scan_until_any, 1);
+
+    rb_define_method(StringScanner, "scan_backward", strscan_scan_backward, 1);
+    rb_define_method(StringScanner, "skip_backward_until", strscan_skip_backward_until, 1);
+    rb_define_method(StringScanner, "rcheck",      strscan_rcheck,      1);
+
+    rb_define_method(StringScanner, "replace",     strscan_replace,     2);
+    rb_define_method(StringScanner, "checkpoint",  strscan_checkpoint,  0);
+    rb_define_method(StringScanner, "checkpoints", strscan_checkpoints, 0);
 
     rb_define_method(StringScanner, "getch",       strscan_getch,       0);
     rb_define_method(StringScanner, "get_byte",    strscan_get_byte,    0);
     rb_define_method(StringScanner, "getbyte",     strscan_getbyte,     0);
+    rb_define_method(StringScanner, "scan_u8",     strscan_scan_u8,     0);
+    rb_define_method(StringScanner, "scan_u16",    strscan_scan_u16,   -1);
+    rb_define_method(StringScanner, "scan_u32",    strscan_scan_u32,   -1);
+    rb_define_method(StringScanner, "scan_u64",    strscan_scan_u64,   -1);
+    rb_define_method(StringScanner, "scan_varint", strscan_scan_varint, 0);
+    rb_define_method(StringScanner, "scan_length_prefixed", strscan_scan_length_prefixed, -1);
+    rb_define_method(StringScanner, "scan_chars",  strscan_scan_chars,  1);
+    rb_define_method(StringScanner, "skip_chars",  strscan_skip_chars,  1);
+    rb_define_method(StringScanner, "scan_quoted", strscan_scan_quoted, -1);
+    rb_define_method(StringScanner, "scan_fields", strscan_scan_fields, -1);
+    rb_define_method(StringScanner, "scan_ident_in", strscan_scan_ident_in, 1);
+    rb_define_method(StringScanner, "skip_trivia", strscan_skip_trivia, -1);
+    rb_define_method(StringScanner, "tokenize",    strscan_tokenize,    2);
     rb_define_method(StringScanner, "peek",        strscan_peek,        1);
     rb_define_method(StringScanner, "peep",        strscan_peep,        1);
+    rb_define_method(StringScanner, "peek_byte",   strscan_peek_byte,  -1);
+    rb_define_method(StringScanner, "peek_eq?",    strscan_peek_eq_p,   1);
+    rb_define_method(StringScanner, "peek_in?",    strscan_peek_in_p,   1);
 
     rb_define_method(StringScanner, "unscan",      strscan_unscan,      0);
 
@@ -1639,12 +5405,17 @@ Init_strscan(void)
     rb_define_method(StringScanner, "matched?",    strscan_matched_p,   0);
     rb_define_method(StringScanner, "matched",     strscan_matched,     0);
     rb_define_method(StringScanner, "matched_size", strscan_matched_size, 0);
+    rb_define_method(StringScanner, "matched_pattern_index", strscan_matched_pattern_index, 0);
     rb_define_method(StringScanner, "[]",          strscan_aref,        1);
     rb_define_method(StringScanner, "pre_match",   strscan_pre_match,   0);
     rb_define_method(StringScanner, "post_match",  strscan_post_match,  0);
     rb_define_method(StringScanner, "size",        strscan_size,        0);
     rb_define_method(StringScanner, "captures",    strscan_captures,    0);
     rb_define_method(StringScanner, "values_at",   strscan_values_at,  -1);
+    rb_define_method(StringScanner, "captures_into", strscan_captures_into, -1);
+    rb_define_method(StringScanner, "values_at_into", strscan_values_at_into, -1);
+    rb_define_method(StringScanner, "named_captures", strscan_named_captures, 0);
+    rb_define_method(StringScanner, "named_captures_into", strscan_named_captures_into, 1);
 
     rb_define_method(StringScanner, "rest",        strscan_rest,        0);
     rb_define_method(StringScanner, "rest_size",   strscan_rest_size,   0);
@@ -1653,4 +5424,7 @@ Init_strscan(void)
     rb_define_method(StringScanner, "inspect",     strscan_inspect,     0);
 
     rb_define_method(StringScanner, "fixed_anchor?", strscan_fixed_anchor_p, 0);
+    rb_define_method(StringScanner, "lookbehind_window", strscan_lookbehind_window, 0);
+    rb_define_method(StringScanner, "regexp_cache_stats", strscan_regexp_cache_stats, 0);
+    rb_define_method(StringScanner, "timeout", strscan_timeout, 0);
 }
@@ -0,0 +1,174 @@
+/*
+    strscan.h - C API of StringScanner
+
+    This program is free software.
+    You can redistribute this program under the terms of the Ruby's or 2-clause
+    BSD License.  For details, see the COPYING and LICENSE.txt files.
+*/
+
+#ifndef RUBY_STRSCAN_H
+#define RUBY_STRSCAN_H 1
+
+#include "ruby/ruby.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*
+ * Lets other extensions drive a StringScanner without method dispatch.
+ * "strscan" must be required before an extension using these is loaded,
+ * and the extension's Init function should call rb_strscan_load_api(),
+ * which raises LoadError if the StringScanner loaded lacks this API, as
+ * the default gem of older Rubies does.
+ *
+ * The header is installed next to strscan.so, so an extconf.rb finds it
+ * with, say:
+ *
+ *   spec = Gem::Specification.find_by_name("strscan")
+ *   find_header("strscan.h", spec.extension_dir,
+ *               File.join(spec.full_gem_path, "ext/strscan"))
+ *   have_func("rb_ext_resolve_symbol", "ruby.h")
+ *
+ * Where rb_ext_resolve_symbol() is available (Ruby 3.3 and later), the
+ * functions are looked up in strscan.so at run time rather than linked
+ * against it.
+ *
+ * Every function takes the scanner object itself and raises TypeError
+ * for anything else, or ArgumentError for an uninitialized scanner.
+ * Positions are byte offsets from the beginning of the scanned string.
+ */
+
+/* the version of this API, StringScanner::C_API_VERSION */
+#define RB_STRSCAN_API_VERSION 1
+
+/*
+ * A token written by StringScanner#tokenize, in native byte order, so
+ * that it unpacks with "QLL".
+ */
+struct rb_strscan_token {
+    uint64_t beg; /* byte offset of the token in the scanned string */
+    uint32_t len; /* its length in bytes */
+    uint32_t id;  /* the index of the rule that matched it */
+};
+
+/* flags of rb_strscan_match() */
+#define RB_STRSCAN_ADVANCE (1 << 0) /* move the scan pointer past the match */
+#define RB_STRSCAN_SEARCH  (1 << 1) /* search ahead instead of anchoring */
+
+/* Declares each function, or a wrapper of a pointer to be resolved. */
+#if defined(HAVE_RB_EXT_RESOLVE_SYMBOL) && !defined(RB_STRSCAN_EXPORT)
+#  define RB_STRSCAN_RESOLVE 1
+#  define RB_STRSCAN_FUNC(type, name, params) \
+    static type (*name##_func) params; \
+    static inline type name params
+#else
+#  define RB_STRSCAN_FUNC(type, name, params) \
+    RUBY_FUNC_EXPORTED type name params
+#endif
+
+/*
+ * Matches +pattern+ as #match? does, or as #scan/#skip do with
+ * RB_STRSCAN_ADVANCE.  With RB_STRSCAN_SEARCH, +pattern+ is searched for
+ * as #check_until does, or #skip_until with RB_STRSCAN_ADVANCE.  Returns
+ * the number of bytes from the scan pointer to the end of the match, or
+ * -1 if it doesn't match.
+ */
+RB_STRSCAN_FUNC(long, rb_strscan_match, (VALUE scanner, VALUE pattern, int flags));
+
+/* Returns the scanned string. */
+RB_STRSCAN_FUNC(VALUE, rb_strscan_string, (VALUE scanner));
+
+/* Returns the scan pointer. */
+RB_STRSCAN_FUNC(long, rb_strscan_pos, (VALUE scanner));
+
+/*
+ * Stores the span of group +i+ of the last match into +beg+ and +end+
+ * and returns 1, or returns 0 if the last match failed or group +i+
+ * didn't participate in it.
+ */
+RB_STRSCAN_FUNC(int, rb_strscan_span, (VALUE scanner, long i, long *beg, long *end));
+
+#ifdef RB_STRSCAN_RESOLVE
+static inline void *
+rb_strscan_resolve(const char *name)
+{
+    void *func = rb_ext_resolve_symbol("strscan.so", name);
+    if (!func) rb_raise(rb_eLoadError, "%s not found in strscan.so", name);
+    return func;
+}
+
+static inline void
+rb_strscan_resolve_api(void)
+{
+    rb_strscan_match_func = (long (*)(VALUE, VALUE, int))
+        (uintptr_t)rb_strscan_resolve("rb_strscan_match");
+    rb_strscan_string_func = (VALUE (*)(VALUE))
+        (uintptr_t)rb_strscan_resolve("rb_strscan_string");
+    rb_strscan_pos_func = (long (*)(VALUE))
+        (uintptr_t)rb_strscan_resolve("rb_strscan_pos");
+    rb_strscan_span_func = (int (*)(VALUE, long, long *, long *))
+        (uintptr_t)rb_strscan_resolve("rb_strscan_span");
+}
+
+static inline long
+rb_strscan_match(VALUE scanner, VALUE pattern, int flags)
+{
+    if (!rb_strscan_match_func) rb_strscan_resolve_api();
+    return rb_strscan_match_func(scanner, pattern, flags);
+}
+
+static inline VALUE
+rb_strscan_string(VALUE scanner)
+{
+    if (!rb_strscan_string_func) rb_strscan_resolve_api();
+    return rb_strscan_string_func(scanner);
+}
+
+static inline long
+rb_strscan_pos(VALUE scanner)
+{
+    if (!rb_strscan_pos_func) rb_strscan_resolve_api();
+    return rb_strscan_pos_func(scanner);
+}
+
+static inline int
+rb_strscan_span(VALUE scanner, long i, long *beg, long *end)
+{
+    if (!rb_strscan_span_func) rb_strscan_resolve_api();
+    return rb_strscan_span_func(scanner, i, beg, end);
+}
+#endif
+
+#ifndef RB_STRSCAN_EXPORT
+/*
+ * Raises LoadError unless the StringScanner loaded has this API.  Call it
+ * from the Init function of an extension using it.
+ */
+static inline void
+rb_strscan_load_api(void)
+{
+    VALUE version = Qnil;
+
+    if (rb_const_defined(rb_cObject, rb_intern("StringScanner"))) {
+        VALUE klass = rb_const_get(rb_cObject, rb_intern("StringScanner"));
+        if (rb_const_defined(klass, rb_intern("C_API_VERSION"))) {
+            version = rb_const_get(klass, rb_intern("C_API_VERSION"));
+        }
+    }
+    if (!FIXNUM_P(version) || FIX2INT(version) < RB_STRSCAN_API_VERSION) {
+        rb_raise(rb_eLoadError,
+                 "StringScanner C API version %d is required; require a newer strscan",
+                 RB_STRSCAN_API_VERSION);
+    }
+#ifdef RB_STRSCAN_RESOLVE
+    rb_strscan_resolve_api();
+#endif
+}
+#endif
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* RUBY_STRSCAN_H */
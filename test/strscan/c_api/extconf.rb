@@ -0,0 +1,12 @@
+# frozen_string_literal: true
+#
+# Builds the extension test_c_api.rb drives the C API of StringScanner
+# through.  Set STRSCAN_HEADER_DIR to build against a strscan.h other
+# than the one in this tree, such as an installed one.
+require 'mkmf'
+header_dir = ENV["STRSCAN_HEADER_DIR"] ||
+             File.expand_path("../../../ext/strscan", __dir__)
+$INCFLAGS << " -I#{header_dir}"
+abort "strscan.h not found in #{header_dir}" unless have_header("strscan.h")
+have_func("rb_ext_resolve_symbol", "ruby.h")
+create_makefile 'strscan_c_api'
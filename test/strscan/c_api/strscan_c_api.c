@@ -0,0 +1,57 @@
+/*
+    strscan_c_api.c - exposes the C API of StringScanner to test_c_api.rb
+
+    This program is free software.
+    You can redistribute this program under the terms of the Ruby's or 2-clause
+    BSD License.  For details, see the COPYING and LICENSE.txt files.
+*/
+
+#include "ruby.h"
+#include "strscan.h"
+
+static VALUE
+c_api_match(VALUE mod, VALUE scanner, VALUE pattern, VALUE flags)
+{
+    long length = rb_strscan_match(scanner, pattern, NUM2INT(flags));
+    if (length < 0) return Qnil;
+    return LONG2NUM(length);
+}
+
+static VALUE
+c_api_string(VALUE mod, VALUE scanner)
+{
+    return rb_strscan_string(scanner);
+}
+
+static VALUE
+c_api_pos(VALUE mod, VALUE scanner)
+{
+    return LONG2NUM(rb_strscan_pos(scanner));
+}
+
+static VALUE
+c_api_span(VALUE mod, VALUE scanner, VALUE i)
+{
+    long beg, end;
+
+    if (!rb_strscan_span(scanner, NUM2LONG(i), &beg, &end)) return Qnil;
+    return rb_assoc_new(LONG2NUM(beg), LONG2NUM(end));
+}
+
+void
+Init_strscan_c_api(void)
+{
+    VALUE mod;
+
+    rb_strscan_load_api();
+    mod = rb_define_module("StringScannerCAPI");
+
+    rb_define_const(mod, "ADVANCE", INT2FIX(RB_STRSCAN_ADVANCE));
+    rb_define_const(mod, "SEARCH", INT2FIX(RB_STRSCAN_SEARCH));
+    rb_define_const(mod, "TOKEN_SIZE",
+                    INT2FIX(sizeof(struct rb_strscan_token)));
+    rb_define_module_function(mod, "match", c_api_match, 3);
+    rb_define_module_function(mod, "string", c_api_string, 1);
+    rb_define_module_function(mod, "pos", c_api_pos, 1);
+    rb_define_module_function(mod, "span", c_api_span, 2);
+}
@@ -0,0 +1,120 @@
+# frozen_string_literal: true
+#
+# test/strscan/test_c_api.rb
+#
+
+require 'strscan'
+require 'test/unit'
+require 'rbconfig'
+require 'tmpdir'
+require 'fileutils'
+
+class TestStringScannerCAPI < Test::Unit::TestCase
+  SOURCE_DIR = File.expand_path("c_api", __dir__)
+
+  # Builds test/strscan/c_api once, or returns nil where it can't be built.
+  def self.build
+    return @built if defined?(@built)
+    @built = nil
+    dir = Dir.mktmpdir("strscan_c_api")
+    at_exit { FileUtils.rm_rf(dir) }
+    log = File.join(dir, "build.log")
+    Dir.chdir(dir) do
+      system(RbConfig.ruby, File.join(SOURCE_DIR, "extconf.rb"),
+             "--srcdir=#{SOURCE_DIR}", [:out, :err] => log) or return
+      system(ENV["MAKE"] || "make", [:out, :err] => log) or return
+    end
+    @built = dir
+  end
+
+  def setup
+    unless defined?(StringScanner::C_API_VERSION)
+      skip("the StringScanner loaded has no C API")
+    end
+    dir = self.class.build
+    skip("the C API test extension couldn't be built") unless dir
+    require File.join(dir, "strscan_c_api.#{RbConfig::CONFIG['DLEXT']}")
+    @api = StringScannerCAPI
+  end
+
+  def test_match
+    s = StringScanner.new("test string")
+    assert_equal(4, @api.match(s, /\w+/, 0))
+    assert_equal(0, s.pos)
+    assert_equal("test", s.matched)
+    assert_nil(@api.match(s, /\s/, 0))
+    assert_nil(s.matched)
+  end
+
+  def test_match_advance
+    s = StringScanner.new("test string")
+    assert_equal(4, @api.match(s, /\w+/, @api::ADVANCE))
+    assert_equal(4, s.pos)
+    assert_equal(1, @api.match(s, " ", @api::ADVANCE))
+    assert_equal(5, @api.pos(s))
+    assert_nil(@api.match(s, /\d/, @api::ADVANCE))
+    assert_equal(5, s.pos)
+  end
+
+  def test_match_search
+    s = StringScanner.new("test string")
+    assert_equal(4, @api.match(s, /s\w/, @api::SEARCH))
+    assert_equal(0, s.pos)
+    assert_equal("st", s.matched)
+    assert_equal(8, @api.match(s, "str", @api::SEARCH))
+    assert_nil(@api.match(s, /x/, @api::SEARCH))
+    assert_equal(0, s.pos)
+  end
+
+  def test_match_advance_search
+    s = StringScanner.new("test string")
+    flags = @api::ADVANCE | @api::SEARCH
+    assert_equal(5, @api.match(s, " ", flags))
+    assert_equal(5, s.pos)
+    assert_equal(6, @api.match(s, /g/, flags))
+    assert_equal(11, s.pos)
+    assert_nil(@api.match(s, /g/, flags))
+  end
+
+  def test_string
+    str = "test string"
+    s = StringScanner.new(str)
+    assert_same(str, @api.string(s))
+  end
+
+  def test_span
+    s = StringScanner.new("Fri Dec 12")
+    s.pos = 4
+    assert_nil(@api.span(s, 0))
+    @api.match(s, /(\w+) (\d+)(x)?/, @api::ADVANCE)
+    assert_equal([4, 10], @api.span(s, 0))
+    assert_equal([4, 7], @api.span(s, 1))
+    assert_equal([8, 10], @api.span(s, 2))
+    assert_nil(@api.span(s, 3))
+    assert_nil(@api.span(s, 4))
+  end
+
+  def test_token_size
+    assert_equal(StringScanner::TOKEN_SIZE, @api::TOKEN_SIZE)
+  end
+
+  def test_load_api
+    extension = $LOADED_FEATURES.grep(/strscan_c_api/).first
+    script = <<~RUBY
+      class StringScanner; end
+      begin
+        require #{extension.dump}
+      rescue LoadError => error
+        puts error.message
+      end
+    RUBY
+    output = IO.popen([RbConfig.ruby, "-e", script], err: [:child, :out], &:read)
+    assert_predicate($?, :success?, output)
+    assert_match(/C API version 1 is required/, output)
+  end
+
+  def test_errors
+    assert_raise(TypeError) { @api.pos(Object.new) }
+    assert_raise(ArgumentError) { @api.pos(StringScanner.allocate) }
+  end
+end
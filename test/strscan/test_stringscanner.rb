@@ -174,6 +174,21 @@ class TestStringScanner < Test::Unit::TestCase
     assert_equal name.object_id, s.string.object_id
   end
 
+  def test_string_frozen
+    s = create_string_scanner("test".freeze)
+    s.limit = 2
+    assert_equal("te", s.rest)
+    s.with_limit(3) { assert_equal("tes", s.rest) }
+    assert_equal("te", s.dup.rest)
+    s.string = "mutable".dup
+    s.string << " string"
+    assert_equal("mutable string", s.rest)
+    s.string = "frozen".freeze
+    s.pos = 3
+    assert_equal("zen", s.rest)
+    assert_equal(false, s.eos?)
+  end
+
   def test_string_append
     s = create_string_scanner('tender'.dup)
     s << 'love'
@@ -206,6 +221,77 @@ class TestStringScanner < Test::Unit::TestCase
     assert_equal 11, s.charpos
   end
 
+  def test_limit
+    s = create_string_scanner("a,b\nc,d\n")
+    assert_nil(s.limit)
+    s.limit = 4
+    assert_equal(4, s.limit)
+    assert_nil(s.scan_until(/d/))
+    assert_equal("a,b\n", s.rest)
+    assert_equal(4, s.rest_size)
+    assert_equal("a,b", s.scan(/[^\n]*/))
+    assert_equal("\n", s.post_match)
+    assert_equal(false, s.eos?)
+    assert_equal("\n", s.scan(/\n\z/))
+    assert_equal(true, s.eos?)
+    assert_nil(s.getch)
+    assert_raise(RangeError) { s.limit = 3 }
+    assert_raise(RangeError) { s.limit = 9 }
+
+    s.limit = nil
+    assert_equal("c,d", s.scan_until(/d/))
+    s.reset_with("ab")
+    assert_nil(s.limit)
+  end
+
+  def test_with_limit
+    s = create_string_scanner("key=value; rest")
+    s.limit = 11
+    assert_equal("value", s.with_limit(9) { s.scan(/\w+=/); s.rest })
+    assert_equal(11, s.limit)
+    assert_equal("value; ", s.rest)
+    assert_raise(RuntimeError) do
+      s.with_limit(10) { raise "error" }
+    end
+    assert_equal(11, s.limit)
+
+    s.with_limit(nil) { s.scan(/[\w; ]+/) }
+    assert_equal(15, s.limit)
+    assert_equal(15, s.pos)
+    assert_equal("", s.rest)
+
+    s = create_string_scanner("key=value")
+    s.with_limit(4) { s.string = "short" }
+    assert_nil(s.limit)
+    assert_equal("short", s.rest)
+    s.limit = 3
+    s.with_limit(5) { s.reset_with("ab") }
+    assert_nil(s.limit)
+    assert_equal("ab", s.rest)
+    s = StringScanner.new("abcdef".dup)
+    s.limit = 5
+    s.with_limit(4) { s.replace(1...6, "") }
+    assert_nil(s.limit)
+    assert_equal("a", s.rest)
+  end
+
+  def test_reset_with
+    s = create_string_scanner("test string")
+    s.scan(/(t)est/)
+    str = "a\nb".dup
+    assert_same(s, s.reset_with(str))
+    assert_same(str, s.string)
+    assert_equal(0, s.pos)
+    assert_equal(false, s.matched?)
+    assert_equal(false, s.fixed_anchor?)
+    assert_equal("a", s.scan(/a/))
+
+    s.reset_with(str, fixed_anchor: true)
+    assert_equal(true, s.fixed_anchor?)
+    assert_equal(2, s.skip(/a\n/))
+    assert_nil(s.skip(/\Ab/))
+  end
+
   def test_concat
     s = create_string_scanner('a'.dup)
     s.scan(/a/)
@@ -336,6 +422,289 @@ class TestStringScanner < Test::Unit::TestCase
     assert_equal nil, s.getch
   end
 
+  def test_getch_after_modification
+    str = "ab".dup
+    s = create_string_scanner(str)
+    assert_equal("a", s.getch)
+    str << "\u00e4"
+    assert_equal("b", s.getch)
+    assert_equal("\u00e4", s.getch)
+    assert_equal(3, s.charpos)
+    s << "\u00f6x"
+    assert_equal("\u00f6", s.getch)
+    assert_equal(4, s.charpos)
+    assert_equal(6, s.pos)
+  end
+
+  def test_scan_chars
+    s = create_string_scanner("ab\u00e4\u3042cd")
+    assert_equal("ab\u00e4", s.scan_chars(3))
+    assert_equal("ab\u00e4", s.matched)
+    assert_equal("", s.pre_match)
+    assert_equal("", s.scan_chars(0))
+    assert_nil(s.scan_chars(4))
+    assert_equal(false, s.matched?)
+    assert_equal(4, s.pos)
+    assert_equal("\u3042cd", s.scan_chars(3))
+    assert_equal(true, s.eos?)
+    assert_raise(ArgumentError) { s.scan_chars(-1) }
+
+    s = create_string_scanner("\u00e4" * 20 + "x" * 20)
+    assert_equal("\u00e4" * 20 + "xxxxx", s.scan_chars(25))
+    assert_equal("x" * 15, s.scan_chars(15))
+
+    s = create_string_scanner("xyz" + "\u3042" * 5)
+    assert_equal("xyz" + "\u3042" * 5, s.scan_chars(8))
+
+    s = create_string_scanner("ab".dup.force_encoding("euc-jp") +
+                              "\244\242".dup.force_encoding("euc-jp"))
+    assert_equal("b\244\242".dup.force_encoding("euc-jp"),
+                 s.tap(&:get_byte).scan_chars(2))
+
+    s = create_string_scanner("\xffab")
+    assert_equal("\xffa", s.scan_chars(2))
+  end
+
+  def test_skip_chars
+    s = create_string_scanner("\u00e4\u00e4a")
+    assert_equal(4, s.skip_chars(2))
+    assert_equal("\u00e4\u00e4", s.matched)
+    assert_nil(s.skip_chars(2))
+    assert_equal(1, s.skip_chars(1))
+  end
+
+  def test_scan_quoted
+    s = create_string_scanner('"a\"b\\\\c\nd\/" rest')
+    assert_equal("a\"b\\c\nd/", s.scan_quoted)
+    assert_equal('"a\"b\\\\c\nd\/"', s.matched)
+    assert_equal(" rest", s.rest)
+    assert_nil(s.scan_quoted)
+    assert_equal(false, s.matched?)
+
+    s = create_string_scanner('"abc')
+    assert_nil(s.scan_quoted)
+    assert_equal(0, s.pos)
+    s = create_string_scanner('"abc\\')
+    assert_nil(s.scan_quoted)
+
+    s = create_string_scanner('"' + "x" * 50 + '\"' + "y" * 20 + '",')
+    assert_equal("x" * 50 + '"' + "y" * 20, s.scan_quoted)
+    assert_equal(",", s.rest)
+  end
+
+  def test_scan_quoted_unicode_escape
+    s = create_string_scanner('"\u00e4\ud83d\ude00\ud83dA\u12"')
+    assert_equal("\u00e4\u{1F600}\u{FFFD}Au12", s.scan_quoted)
+  end
+
+  def test_scan_quoted_options
+    s = create_string_scanner(%q{'it''s',''})
+    assert_equal("it's", s.scan_quoted(quote: "'", escape: "'"))
+    assert_equal(",", s.get_byte)
+    assert_equal("", s.scan_quoted(quote: "'", escape: "'"))
+
+    s = create_string_scanner('"a\"b" "a\"b"')
+    assert_equal('a\"b', s.scan_quoted(unescape: false))
+    s.skip(/ /)
+    assert_equal('a\\', s.scan_quoted(escape: nil))
+
+    assert_raise(ArgumentError) { s.scan_quoted(quote: "ab") }
+    assert_raise(ArgumentError) { s.scan_quoted(escape: "ä") }
+  end
+
+  def test_scan_quoted_shift_jis
+    str = "\"\x95\x5c\"".dup.force_encoding("Shift_JIS")
+    s = create_string_scanner(str)
+    assert_equal("\x95\x5c".dup.force_encoding("Shift_JIS"), s.scan_quoted)
+  end
+
+  def test_scan_fields
+    s = create_string_scanner("a,b,c\nd,,\"e,\"\"f\"\"\n\"\r\ng")
+    assert_equal(["a", "b", "c"], s.scan_fields)
+    assert_equal("a,b,c\n", s.matched)
+    assert_equal(["d", "", "e,\"f\"\n"], s.scan_fields)
+    assert_equal(["g"], s.scan_fields)
+    assert_equal(true, s.eos?)
+    assert_nil(s.scan_fields)
+
+    s = create_string_scanner("a,b\r\n,\n")
+    assert_equal(["a", "b"], s.scan_fields)
+    assert_equal(["", ""], s.scan_fields)
+    assert_nil(s.scan_fields)
+  end
+
+  def test_scan_fields_incomplete
+    s = create_string_scanner("a,\"b".dup)
+    assert_nil(s.scan_fields)
+    assert_equal(0, s.pos)
+    assert_nil(s.matched)
+    s.concat("\"\"c\",d")
+    assert_equal(["a", "b\"c", "d"], s.scan_fields)
+  end
+
+  def test_scan_fields_options
+    s = create_string_scanner("a\t'b\tc'\t\"d\";e")
+    assert_equal(["a", "b\tc", "\"d\";e"], s.scan_fields(sep: "\t", quote: "'"))
+
+    s = create_string_scanner("\"a\",b;c,d")
+    assert_equal(["\"a\"", "b"], s.scan_fields(quote: nil, eol: ";"))
+    assert_equal(["c", "d"], s.scan_fields(quote: nil, eol: ";"))
+
+    s = create_string_scanner("ab,\"c\"\"d\"\n")
+    assert_equal([0, 2, 4, 8], s.scan_fields(mode: :span))
+
+    assert_raise(ArgumentError) { s.scan_fields(sep: "\n") }
+    assert_raise(ArgumentError) { s.scan_fields(sep: "ab") }
+  end
+
+  def test_scan_ident_in
+    keywords = {"if" => :if, "end" => :end, "caf\u00e9" => :cafe}
+    s = create_string_scanner("if _x1 caf\u00e9 endif 9end")
+    assert_equal(:if, s.scan_ident_in(keywords))
+    assert_equal("if", s.matched)
+    s.skip(/ /)
+    assert_equal("_x1", s.scan_ident_in(keywords))
+    assert_equal(6, s.pos)
+    s.skip(/ /)
+    assert_equal(:cafe, s.scan_ident_in(keywords))
+    s.skip(/ /)
+    assert_equal("endif", s.scan_ident_in(keywords))
+    s.skip(/ /)
+    assert_nil(s.scan_ident_in(keywords))
+    assert_equal(false, s.matched?)
+    s.skip(/9/)
+    assert_equal(:end, s.scan_ident_in(keywords))
+    assert_nil(s.scan_ident_in(keywords))
+    assert_raise(TypeError) { s.scan_ident_in(["end"]) }
+  end
+
+  def test_scan_ident_in_multibyte
+    sjis = "\x95\x5c x".dup.force_encoding("Shift_JIS")
+    s = create_string_scanner(sjis)
+    assert_equal(sjis[0, 1], s.scan_ident_in({}))
+    assert_equal(2, s.pos)
+  end
+
+  def test_skip_trivia
+    s = create_string_scanner("  // note\n  /* a\n * b */\tx /* open".dup)
+    assert_equal(25, s.skip_trivia)
+    assert_equal(25, s.matched_size)
+    assert_nil(s.skip_trivia)
+    assert_equal("x", s.scan(/x/))
+    assert_equal(1, s.skip_trivia(:c))
+    assert_equal("/* open", s.rest)
+    s << " */"
+    assert_equal(10, s.skip_trivia)
+    assert_predicate(s, :eos?)
+    assert_nil(s.skip_trivia)
+  end
+
+  def test_skip_trivia_newlines
+    s = create_string_scanner("\n# a\n  # b\n\nx")
+    assert_equal(4, s.skip_trivia(:shell, newlines: true))
+    assert_equal("x", s.scan(/x/))
+    s = create_string_scanner(" /* \n\n */ y")
+    assert_equal(2, s.skip_trivia(newlines: true))
+    assert_equal(" /* \n\n */ ", s.matched)
+  end
+
+  def test_skip_trivia_styles
+    s = create_string_scanner("-- a\n/* b */ SELECT")
+    assert_equal(13, s.skip_trivia(:sql))
+    s = create_string_scanner("// a\n")
+    assert_nil(s.skip_trivia(:shell))
+    s = create_string_scanner("-- a\n--[[ b\n]] --[==[ ]] ]==]x --[[ c")
+    assert_equal(29, s.skip_trivia(:lua))
+    assert_equal("x --[[ c", s.rest)
+    s.scan(/x/)
+    assert_equal(1, s.skip_trivia(:lua))
+    assert_equal("--[[ c", s.rest)
+    assert_raise(ArgumentError) { s.skip_trivia(:ruby) }
+  end
+
+  def test_skip_trivia_custom
+    style = {line: [";", "#"], block: [["{", "}"], ["(*", "*)"]]}
+    s = create_string_scanner("; a\n# b\n{ c } (* d *) e")
+    assert_equal(22, s.skip_trivia(style))
+    assert_equal("e", s.rest)
+    s = create_string_scanner("%% a\n%%{ b }%%f")
+    assert_equal(14, s.skip_trivia({line: "%%", block: ["%%{", "}%%"]}))
+    assert_raise(ArgumentError) { s.skip_trivia({line: ""}) }
+    delimiter = Object.new
+    def delimiter.to_str; "#"; end
+    assert_raise(TypeError) { s.skip_trivia({line: delimiter}) }
+  end
+
+  def test_tokenize
+    rules = [/\d+/, /\w+/, /\s+/, "+", /x*/]
+    s = create_string_scanner("x sum + 42 -")
+    s.scan("x")
+    tokens = String.new
+    assert_equal(7, s.tokenize(rules, tokens))
+    assert_equal(7 * StringScanner::TOKEN_SIZE, tokens.bytesize)
+    assert_equal([1, 1, 2, 2, 3, 1], tokens.unpack("QLL" * 2))
+    assert_equal(11, s.pos)
+    assert_equal(" ", s.matched)
+    assert_equal(2, s.matched_pattern_index)
+
+    assert_equal(0, s.tokenize(rules, tokens))
+    assert_equal(7 * StringScanner::TOKEN_SIZE, tokens.bytesize)
+    assert_nil(s.matched)
+    assert_raise(ArgumentError) { s.tokenize(rules, s.string) }
+    assert_raise(TypeError) { s.tokenize([:x], tokens) }
+  end
+
+  def test_tokenize_captures
+    s = create_string_scanner("ab ab")
+    tokens = String.new
+    assert_equal(3, s.tokenize([/(a)(b)/, /\s/], tokens))
+    assert_equal("ab", s.matched)
+    assert_equal("a", s[1])
+    assert_equal("b", s[2])
+    assert_equal(3, s.pre_match.bytesize)
+
+    s = create_string_scanner("ab c")
+    assert_equal(3, s.tokenize([/(?<x>a)b/, /\s/, "c"], tokens))
+    assert_equal("c", s.matched)
+    assert_nil(s[1])
+    s = create_string_scanner("ab")
+    s.tokenize([/(?<x>a)b/], tokens)
+    assert_equal("a", s[:x])
+  end
+
+  def test_tokenize_io_buffer
+    skip("IO::Buffer isn't available") unless defined?(IO::Buffer)
+    experimental, Warning[:experimental] = Warning[:experimental], false
+    s = create_string_scanner("a b c")
+    buffer = IO::Buffer.new(2 * StringScanner::TOKEN_SIZE)
+    assert_equal(2, s.tokenize([/\w/, / /], buffer))
+    assert_equal(2, s.pos)
+    assert_equal(1, s.matched_pattern_index)
+    assert_equal([[0, 0, 1], [1, 1, 2]],
+                 StringScanner.each_token(buffer, 2).to_a)
+    assert_equal(2, s.tokenize([/\w/, / /], buffer))
+    assert_equal([[0, 2, 3], [1, 3, 4]],
+                 StringScanner.each_token(buffer, 2).to_a)
+  ensure
+    Warning[:experimental] = experimental unless experimental.nil?
+  end
+
+  def test_each_token
+    s = create_string_scanner("if x")
+    tokens = String.new
+    s.tokenize(["if", /\w+/, /\s+/], tokens)
+    assert_equal([[0, 0, 2], [2, 2, 3], [1, 3, 4]],
+                 StringScanner.each_token(tokens).to_a)
+    assert_equal([[0, 0, 2]], StringScanner.each_token(tokens, 1).to_a)
+    assert_raise(ArgumentError) { StringScanner.each_token(tokens, 4) }
+    ids = []
+    StringScanner.each_token(tokens) do |id, |
+      ids << id
+      tokens.clear
+    end
+    assert_equal([0], ids)
+  end
+
   def test_get_byte
     s = create_string_scanner('abcde')
     assert_equal 'a', s.get_byte
@@ -357,6 +726,50 @@ class TestStringScanner < Test::Unit::TestCase
     assert_equal nil, s.get_byte
   end
 
+  def test_scan_uint
+    s = create_string_scanner("\x01\x02\x03\x04\x05\x06\x07\x08\xff".b)
+    assert_equal(0x0102, s.scan_u16)
+    assert_equal("\x01\x02".b, s.matched)
+    assert_equal(0x0403, s.scan_u16(:little))
+    assert_equal(0x05, s.scan_u8)
+    assert_nil(s.scan_u64)
+    assert_equal(false, s.matched?)
+    assert_equal(5, s.pos)
+    s.pos = 0
+    assert_equal(0x01020304, s.scan_u32)
+    s.pos = 1
+    assert_equal(0x020304050607_08ff, s.scan_u64(:big))
+    s.pos = 1
+    assert_equal(0xff08070605040302, s.scan_u64(:little))
+    assert_nil(s.scan_u8)
+    assert_equal([1].pack("S").unpack1("S"), create_string_scanner("\x01\x00").scan_u16(:native))
+    assert_raise(ArgumentError) { s.scan_u16(:middle) }
+  end
+
+  def test_scan_varint
+    s = create_string_scanner("\x96\x01\x00\xff\xff\xff\xff\xff\xff\xff\xff\xff\x01\x80".b)
+    assert_equal(150, s.scan_varint)
+    assert_equal(2, s.matched_size)
+    assert_equal(0, s.scan_varint)
+    assert_equal(2**64 - 1, s.scan_varint)
+    assert_nil(s.scan_varint)
+    assert_equal(13, s.pos)
+
+    s = create_string_scanner("\xff\xff\xff\xff\xff\xff\xff\xff\xff\x02".b)
+    assert_raise(RangeError) { s.scan_varint }
+  end
+
+  def test_scan_length_prefixed
+    s = create_string_scanner("\x00\x03abc\x02de\x03\x00\x00\x00fgh\x05ij".b)
+    assert_equal("abc", s.scan_length_prefixed(2))
+    assert_equal("\x00\x03abc".b, s.matched)
+    assert_equal("de", s.scan_length_prefixed(:varint))
+    assert_equal("fgh", s.scan_length_prefixed(4, :little))
+    assert_nil(s.scan_length_prefixed(1))
+    assert_equal(15, s.pos)
+    assert_raise(ArgumentError) { s.scan_length_prefixed(3) }
+  end
+
   def test_matched
     s = create_string_scanner('stra strb strc')
     s.scan(/\w+/)
@@ -613,9 +1026,71 @@ class TestStringScanner < Test::Unit::TestCase
 
   def test_exist_p_string
     s = create_string_scanner("test string")
-    assert_raise(TypeError) do
-      s.exist?(" ")
+    assert_equal(5, s.exist?(" "))
+    assert_equal(0, s.pos)
+    assert_equal(" ", s.matched)
+    assert_equal("test", s.pre_match)
+    assert_equal(3, s.exist?("s"))
+    assert_nil(s.exist?("x"))
+  end
+
+  def test_scan_until_string
+    s = create_string_scanner("Fri Dec 12 1975 14:39")
+    assert_equal("Fri Dec 1", s.scan_until("1"))
+    assert_equal("1", s.matched)
+    assert_equal("Fri Dec ", s.pre_match)
+    assert_equal(3, s.skip_until(" 1"))
+    assert_equal("975", s.check_until("975"))
+    assert_equal(12, s.pos)
+    assert_nil(s.scan_until("XYZ"))
+    assert_equal("", s.scan_until(""))
+  end
+
+  def test_scan_until_string_multibyte
+    s = create_string_scanner("\u00e4\u00f6\u00fc \u00f6")
+    assert_equal("\u00e4\u00f6", s.scan_until("\u00f6"))
+    assert_equal("\u00fc \u00f6", s.scan_until("\u00f6"))
+  end
+
+  def test_scan_ignore_case
+    s = create_string_scanner("Content-Type: TEXT/html")
+    assert_nil(s.scan("content-type"))
+    assert_equal("Content-Type", s.scan("content-type", ignore_case: true))
+    assert_equal(": ", s.scan(": ", ignore_case: true))
+    assert_equal(4, s.match?("text", ignore_case: true))
+    assert_equal("TEXT", s.check("Text", ignore_case: true))
+    assert_equal(4, s.skip("tExT", ignore_case: true))
+    assert_nil(s.scan("/HTMLX", ignore_case: true))
+    assert_equal("/html", s.scan("/HTML", ignore_case: true))
+    assert_predicate(s, :eos?)
+  end
+
+  def test_scan_until_ignore_case
+    s = create_string_scanner("GET /index HTTP/1.1\r\nHOST: example.com\r\n")
+    assert_equal("GET /index HTTP/1.1\r\nHOST:",
+                 s.scan_until("host:", ignore_case: true))
+    assert_equal("HOST:", s.matched)
+    assert_equal(8, s.exist?("Example", ignore_case: true))
+    assert_equal(" example.com", s.check_until(".COM", ignore_case: true))
+    assert_equal(14, s.skip_until("\r\n", ignore_case: true))
+    assert_nil(s.scan_until("x", ignore_case: true))
+  end
+
+  def test_scan_ignore_case_unicode
+    s = create_string_scanner("\u212Aelvin Stra\u00DFe STRASSE")
+    assert_equal("\u212Aelvin", s.scan("KELVIN", ignore_case: true))
+    assert_equal(" Stra", s.scan_until("stra", ignore_case: true))
+    assert_equal("\u00DFe", s.scan("sse", ignore_case: true))
+    assert_equal(" STRASSE", s.scan_until("stra\u00DFe", ignore_case: true))
+    assert_predicate(s, :eos?)
+  end
+
+  def test_scan_ignore_case_regexp
+    s = create_string_scanner("test")
+    assert_raise(ArgumentError) do
+      s.scan(/TEST/, ignore_case: true)
     end
+    assert_equal("test", s.scan(/TEST/i, ignore_case: false))
   end
 
   def test_skip_until
@@ -636,6 +1111,299 @@ class TestStringScanner < Test::Unit::TestCase
     assert_equal(nil, s.check_until(/Qux/))
   end
 
+  def test_scan_until_any
+    s = create_string_scanner("Hello ${name}, <%= n %>")
+    assert_equal("Hello ${", s.scan_until_any(["<%", "${", /\n/]))
+    assert_equal(1, s.matched_pattern_index)
+    assert_equal("${", s.matched)
+    assert_equal("Hello ", s.pre_match)
+    assert_equal("name}", s.scan_until_any(["<%", "}"]))
+    assert_equal(1, s.matched_pattern_index)
+    assert_equal(", <%= n", s.scan_until_any([/<%=\s*(\w+)/, "<%"]))
+    assert_equal(0, s.matched_pattern_index)
+    assert_equal("n", s[1])
+    assert_nil(s.scan_until_any([/\n/, "x"]))
+    assert_nil(s.matched_pattern_index)
+    s.scan(/ /)
+    assert_nil(s.matched_pattern_index)
+  end
+
+  def test_scan_until_any_ties
+    s = create_string_scanner("aab")
+    assert_equal("aab", s.scan_until_any([/b/, "b"]))
+    assert_equal(0, s.matched_pattern_index)
+    s.reset
+    assert_equal("aab", s.scan_until_any(["b", /a(b)/]))
+    assert_equal(1, s.matched_pattern_index)
+    assert_equal("b", s[1])
+    s.reset
+    assert_equal("a", s.scan_until_any([/(a)(b)/, /a/]))
+    assert_equal(1, s.matched_pattern_index)
+    s.reset
+    assert_equal("", s.scan_until_any(["b", "", "a"]))
+    assert_equal(1, s.matched_pattern_index)
+  end
+
+  def test_scan_until_any_many_literals
+    s = create_string_scanner("\u00e4\u00f6 x-y+z")
+    assert_equal("\u00e4\u00f6 x-", s.scan_until_any(["+", "-", "*", "/", "\u00fc"]))
+    assert_equal(1, s.matched_pattern_index)
+    assert_equal("y+", s.scan_until_any(["+", "-", "*", "/", "\u00fc"]))
+    assert_raise(TypeError) { s.scan_until_any([:z]) }
+  end
+
+  def test_scan_backward
+    s = create_string_scanner("total: 1975")
+    s.terminate
+    assert_equal("1975", s.scan_backward(/\d+/))
+    assert_equal(7, s.pos)
+    assert_equal("1975", s.matched)
+    assert_equal("total: ", s.pre_match)
+    assert_equal("", s.post_match)
+    assert_nil(s.scan_backward(/\d+/))
+    assert_nil(s.matched)
+    assert_equal(": ", s.scan_backward(": "))
+    assert_equal(5, s.pos)
+    s.unscan
+    assert_equal(7, s.pos)
+    assert_equal("l: ", s.scan_backward(/(\w): /))
+    assert_equal("l", s[1])
+    assert_equal("tota", s.pre_match)
+    assert_nil(s.scan_backward("x"))
+    assert_equal("", s.scan_backward(""))
+  end
+
+  def test_scan_backward_multibyte
+    s = create_string_scanner("\u00e4\u00e4")
+    s.terminate
+    assert_nil(s.scan_backward("\xA4\xC3\xA4".b.force_encoding("UTF-8")))
+    assert_equal("\u00e4\u00e4", s.scan_backward(/\u00e4+/))
+    assert_equal(0, s.pos)
+
+    s = create_string_scanner("x" + "\u3042" * 37 + "a\u00e4" * 5)
+    s.terminate
+    assert_equal("a\u00e4" * 5, s.scan_backward(/[a\u00e4]+/))
+    assert_equal("\u3042" * 37, s.scan_backward(/\p{Hiragana}+/))
+    assert_equal(1, s.pos)
+  end
+
+  def test_scan_backward_repeating_units
+    s = create_string_scanner("xababab")
+    s.terminate
+    assert_equal("ababab", s.scan_backward(/(?:ab)+/))
+    assert_equal(1, s.pos)
+    s = create_string_scanner("x1a2b3c")
+    s.terminate
+    assert_equal("1a2b3c", s.rcheck(/(?:\d[a-j])+/))
+    s = create_string_scanner("x\u00e4\u3042\u00e4\u3042")
+    s.terminate
+    assert_equal("\u00e4\u3042" * 2, s.scan_backward(/(?:\u00e4\u3042)+/))
+    assert_equal(1, s.pos)
+    s = create_string_scanner("ab\u00e4b\u00e4")
+    s.terminate
+    assert_equal("b\u00e4b\u00e4", s.scan_backward(/(?:b\u00e4)+/))
+    assert_equal("a", s.pre_match)
+  end
+
+  def test_scan_backward_long
+    s = create_string_scanner("x " + "1" * 100_000)
+    s.terminate
+    assert_equal(100_000, s.scan_backward(/\d+/).bytesize)
+    assert_equal(2, s.pos)
+
+    s = create_string_scanner("1" * 100_000 + "x")
+    s.terminate
+    assert_nil(s.rcheck(/\d+/))
+    assert_nil(s.scan_backward(/\d+/))
+  end
+
+  def test_skip_backward_until
+    s = create_string_scanner("a=1;b=2;c=3")
+    s.terminate
+    assert_equal(4, s.skip_backward_until(";"))
+    assert_equal(7, s.pos)
+    assert_equal(";", s.matched)
+    assert_equal("c=3", s.post_match)
+    assert_equal(2, s.skip_backward_until(/=/))
+    assert_equal(5, s.pos)
+    assert_equal(2, s.skip_backward_until(/;(\w)/))
+    assert_equal("b", s[1])
+    assert_equal(3, s.pos)
+    assert_nil(s.skip_backward_until(";"))
+    assert_nil(s.skip_backward_until(/b/))
+    assert_equal(3, s.pos)
+  end
+
+  def test_rcheck
+    s = create_string_scanner("log line *1A")
+    s.terminate
+    assert_equal("*1A", s.rcheck(/\*\h+/))
+    assert_equal(12, s.pos)
+    assert_equal("log line ", s.pre_match)
+    s.pos = 8
+    assert_equal("line", s.rcheck("line"))
+    assert_nil(s.rcheck(/log/))
+  end
+
+  def test_replace
+    s = create_string_scanner("a = 1; b = 2".dup)
+    until s.eos?
+      s.skip(/\s+/)
+      s.checkpoint
+      s.scan(/\w+|\S/)
+    end
+    assert_equal([0, 2, 4, 5, 7, 9, 11], s.checkpoints)
+    s.scan(/x/)
+    assert_equal(2, s.replace(4...5, "42"))
+    assert_equal("a = 42; b = 2", s.string)
+    assert_equal([0, 8, 10, 12], s.checkpoints)
+    assert_equal(2, s.pos)
+    assert_equal(false, s.matched?)
+
+    assert_equal(0, s.replace(0...0, "c"))
+    assert_equal("ca = 42; b = 2", s.string)
+    assert_raise(RangeError) { s.replace(20..21, "") }
+    assert_raise(TypeError) { s.replace("0", "") }
+    frozen_error = defined?(FrozenError) ? FrozenError : RuntimeError
+    assert_raise(frozen_error) { create_string_scanner("a").replace(0..0, "b") }
+
+    s = create_string_scanner("\u00e4b".dup)
+    assert_raise(IndexError) { s.replace(1..1, "") }
+    s.replace(0..1, "\u00f6\u00fc")
+    assert_equal("\u00f6\u00fcb", s.string)
+    assert_equal("\u00f6", s.getch)
+
+    s = create_string_scanner("\u00e4b".dup)
+    s.replace(0..1, "x")
+    assert_equal("xb", s.string)
+    assert_predicate(s.string, :ascii_only?)
+    assert_equal("xb".hash, s.string.hash)
+    assert_equal(1, {"xb" => 1}[s.string])
+  end
+
+  def test_replace_incremental
+    token = /\w+|==?|\S/
+    tokenize = lambda do |string|
+      s = StringScanner.new(string)
+      tokens = {}
+      until s.skip(/\s*/) && s.eos?
+        tokens[s.pos] = s.scan(token)
+      end
+      tokens
+    end
+    random = Random.new(43)
+    alphabet = ["a", "b", " ", "=", "1", "\u00e4"]
+    200.times do
+      string = Array.new(random.rand(0..20)) { alphabet.sample(random: random) }.join
+      s = create_string_scanner(string.dup)
+      tokens = {}
+      until s.skip(/\s*/) && s.eos?
+        s.checkpoint
+        tokens[s.pos] = s.scan(token)
+      end
+      3.times do
+        chars = s.string.chars
+        b = random.rand(0..chars.size)
+        e = random.rand(b..chars.size)
+        beg_byte = chars[0...b].join.bytesize
+        end_byte = chars[0...e].join.bytesize
+        text = Array.new(random.rand(0..3)) { alphabet.sample(random: random) }.join
+        delta = text.bytesize - (end_byte - beg_byte)
+        resume = s.replace(beg_byte...end_byte, text)
+
+        # keep the tokens before the resume point, move those after the edit
+        moved = {}
+        tokens.each do |pos, t|
+          moved[pos] = t if pos < resume
+          moved[pos + delta] = t if pos > end_byte
+        end
+        tokens = moved.select { |pos, _| pos < resume }
+        until s.skip(/\s*/) && s.eos?
+          if s.checkpoint
+            moved.each { |pos, t| tokens[pos] = t if pos >= s.pos }
+            break
+          end
+          tokens[s.pos] = s.scan(token)
+        end
+        assert_equal(tokenize.call(s.string).sort, tokens.sort, s.string)
+        assert_equal(s.string.b.ascii_only?, s.string.ascii_only?)
+      end
+    end
+  end
+
+  def test_checkpoint
+    s = create_string_scanner("ab cd ef".dup)
+    until s.eos?
+      s.skip(/ /)
+      assert_equal(false, s.checkpoint)
+      s.scan(/\w+/)
+    end
+    assert_equal(0, s.replace(1..1, "x y"))
+    assert_equal("ax y cd ef", s.string)
+    assert_equal([5, 8], s.checkpoints)
+    results = []
+    until s.eos?
+      s.skip(/ /)
+      results << [s.pos, s.checkpoint]
+      break if results.last[1]
+      s.scan(/\w+/)
+    end
+    assert_equal([[0, false], [3, false], [5, true]], results)
+    assert_equal([0, 3, 5, 8], s.checkpoints)
+
+    assert_equal(0, s.replace(3...4, "zz zz"))
+    assert_equal([9, 12], s.checkpoints)
+    s.pos = 12
+    assert_equal(true, s.checkpoint)
+    assert_equal([12], s.checkpoints)
+
+    s = create_string_scanner("a b c")
+    until s.eos?
+      s.skip(/ /)
+      s.checkpoint
+      s.scan(/\w/)
+    end
+    s.reset
+    assert_equal(true, s.checkpoint)
+    s.skip(/a b /)
+    assert_equal([0, 4], s.checkpoints)
+  end
+
+  def test_timeout
+    skip("Regexp#timeout is not available") unless Regexp.method_defined?(:timeout)
+    pattern = /(a*)*\1$/
+    s = StringScanner.new("a" * 30 + "!", timeout: 0.05)
+    assert_equal(0.05, s.timeout)
+    assert_raise(StringScanner::MatchLimitError) { s.scan(pattern) }
+    assert_raise(StringScanner::MatchLimitError) { s.scan_until(pattern) }
+    assert_nil(pattern.timeout)
+    assert_equal(0, s.pos)
+    assert_equal("aaa", s.scan(/a{3}/))
+    assert_equal("a", s[1]) if s.scan(/(a)/)
+    assert_nil(StringScanner.new("a").timeout)
+  end
+
+  def test_timeout_infinity
+    skip("Regexp#timeout is not available") unless Regexp.method_defined?(:timeout)
+    s = StringScanner.new("abc", timeout: Float::INFINITY)
+    assert_operator(s.timeout, :>, 1e9)
+    assert_equal("abc", s.scan(/\w+/))
+  end
+
+  def test_timeout_not_implemented
+    skip("Regexp#timeout is available") if Regexp.method_defined?(:timeout)
+    assert_raise(NotImplementedError) { StringScanner.new("a", timeout: 1) }
+  end
+
+  def test_timeout_invalid
+    skip("Regexp#timeout is not available") unless Regexp.method_defined?(:timeout)
+    assert_raise(ArgumentError) { StringScanner.new("a", timeout: 0) }
+    assert_raise(ArgumentError) { StringScanner.new("a", timeout: -1) }
+    s = StringScanner.new("a", timeout: 1)
+    s.reset_with("b")
+    assert_nil(s.timeout)
+  end
+
   def test_search_full
     s = create_string_scanner("Foo Bar Baz")
     assert_equal(8, s.search_full(/Bar /, false, false))
@@ -659,6 +1427,42 @@ class TestStringScanner < Test::Unit::TestCase
     assert_equal("", s.peek(10))
   end
 
+  def test_peek_byte
+    s = create_string_scanner("ab\u00e4")
+    assert_equal(97, s.peek_byte)
+    assert_equal(0xc3, s.peek_byte(2))
+    assert_nil(s.peek_byte(4))
+    s.scan(/a/)
+    assert_equal(98, s.peek_byte)
+    assert_equal("a", s.matched)
+    assert_raise(ArgumentError) { s.peek_byte(-1) }
+  end
+
+  def test_peek_eq_p
+    s = create_string_scanner("--flag")
+    s.scan(/-/)
+    assert_equal(true, s.peek_eq?("-f"))
+    assert_equal(false, s.peek_eq?("--"))
+    assert_equal(false, s.peek_eq?("-flags"))
+    assert_equal(true, s.peek_eq?(""))
+    assert_equal(1, s.pos)
+    assert_equal("-", s.matched)
+  end
+
+  def test_peek_in_p
+    s = create_string_scanner("+\u00e4")
+    assert_equal(true, s.peek_in?("-+"))
+    assert_equal(false, s.peek_in?("\u00e4"))
+    s.scan(/\+/)
+    assert_equal(true, s.peek_in?("a\u00e4"))
+    assert_equal(false, s.peek_in?("\u00e5a"))
+    s.terminate
+    assert_equal(false, s.peek_in?("+"))
+
+    s = create_string_scanner("\\".encode("Shift_JIS"))
+    assert_equal(false, s.peek_in?("\u8868".encode("Shift_JIS")))
+  end
+
   def test_unscan
     s = create_string_scanner('test string')
     assert_equal("test", s.scan(/\w+/))
@@ -710,6 +1514,66 @@ class TestStringScanner < Test::Unit::TestCase
     assert_equal(4, s.size)
   end
 
+  def test_size_after_capture_less_match
+    s = create_string_scanner("abcde")
+    s.scan(/(a)(b)/)
+    assert_equal(3, s.size)
+    s.scan("c")
+    assert_equal(1, s.size)
+    assert_nil(s[1])
+    s.scan(/(d)/)
+    assert_equal("d", s[1])
+    s.scan(/e/)
+    assert_equal(1, s.size)
+    assert_equal(["e", nil], s.values_at(0, 1))
+    assert_equal("abcd", s.pre_match)
+  end
+
+  def test_memsize
+    require "objspace"
+    s = create_string_scanner("test string")
+    size = ObjectSpace.memsize_of(s)
+    s.scan("test")
+    s.scan(/\s/)
+    s.get_byte
+    s.getch
+    assert_equal(size, ObjectSpace.memsize_of(s))
+    s.scan(/(r)(i)/)
+    assert_operator(size, :<, ObjectSpace.memsize_of(s))
+  end
+
+  def test_regexp_cache
+    require "objspace"
+    latin1 = create_string_scanner("caf\xE9 au lait".dup.force_encoding("ISO-8859-1"))
+    sjis = create_string_scanner("ab\x82\xA0".dup.force_encoding("Shift_JIS"))
+    assert_equal({hits: 0, misses: 0, size: 0}, latin1.regexp_cache_stats)
+    size = ObjectSpace.memsize_of(latin1)
+    re = /[a-z]+/
+    3.times do
+      latin1.reset
+      assert_equal(3, latin1.skip(re))
+      sjis.reset
+      assert_equal(2, sjis.skip(re))
+    end
+    assert_equal({hits: 2, misses: 1, size: 1}, latin1.regexp_cache_stats)
+    assert_equal({hits: 2, misses: 1, size: 1}, sjis.regexp_cache_stats)
+    assert_operator(size, :<, ObjectSpace.memsize_of(latin1))
+
+    10.times do |i|
+      latin1.reset
+      latin1.skip(Regexp.new("caf\\W#{i}?"))
+    end
+    assert_equal(8, latin1.regexp_cache_stats[:size])
+    latin1.reset
+    assert_equal(3, latin1.skip(/\w+/))
+    assert_equal(2, latin1.regexp_cache_stats[:hits])
+
+    broken = create_string_scanner("\xE9".dup.force_encoding("UTF-8"))
+    assert_raise(ArgumentError) { broken.skip(re) }
+    latin1.reset
+    assert_equal(3, latin1.skip(re))
+  end
+
   def test_captures
     s = create_string_scanner("Timestamp: Fri Dec 12 1975 14:39")
     s.scan("Timestamp: ")
@@ -728,6 +1592,66 @@ class TestStringScanner < Test::Unit::TestCase
     assert_nil(s.values_at(0, -1, 5, 2))
   end
 
+  def test_captures_into
+    ary = [:garbage] * 5
+    s = create_string_scanner("Timestamp: Fri Dec 12 1975 14:39")
+    s.scan("Timestamp: ")
+    s.scan(/(\w+) (\w+) (\d+) (x)?/)
+    assert_same(ary, s.captures_into(ary))
+    assert_equal(["Fri", "Dec", "12", nil], ary)
+    assert_equal(["Fri", "Dec", "12", nil], s.captures_into(ary, mode: :shared))
+    assert_equal([11, 14, 15, 18, 19, 21, nil, nil],
+                 s.captures_into(ary, mode: :span))
+    assert_raise(ArgumentError) { s.captures_into(ary, mode: :unknown) }
+    s.scan(/(\w+) (\w+) (\d+) /)
+    assert_nil(s.captures_into(ary))
+    assert_equal([], ary)
+  end
+
+  def test_values_at_into
+    ary = []
+    s = create_string_scanner("Timestamp: Fri Dec 12 1975 14:39")
+    s.scan("Timestamp: ")
+    s.scan(/(?<wday>\w+) (?<month>\w+) (?<day>\d+) /)
+    assert_same(ary, s.values_at_into(ary, 0, -1, 5, :wday))
+    assert_equal(["Fri Dec 12 ", "12", nil, "Fri"], ary)
+    assert_equal([11, 22, nil, nil],
+                 s.values_at_into(ary, 0, 5, mode: :span))
+    assert_equal(["Dec"], s.values_at_into(ary, 2, mode: :shared))
+    s.scan(/(\w+) (\w+) (\d+) /)
+    assert_nil(s.values_at_into(ary, 0, -1, 5, 2))
+    assert_equal([], ary)
+  end
+
+  def test_named_captures
+    s = create_string_scanner("Fri Dec 12 1975 14:39")
+    assert_equal({}, s.named_captures)
+    s.scan(/(?<wday>\w+) (?<month>\w+) (?<day>\d+) /)
+    assert_equal({"wday" => "Fri", "month" => "Dec", "day" => "12"},
+                 s.named_captures)
+    s.scan(/(?<wday>\w+) (?<month>\w+) (?<day>\d+) /)
+    assert_equal({"wday" => nil, "month" => nil, "day" => nil},
+                 s.named_captures)
+  end
+
+  def test_named_captures_same_name
+    s = create_string_scanner("b")
+    s.scan(/(?<x>a)|(?<x>b)/)
+    assert_equal({"x" => "b"}, s.named_captures)
+  end
+
+  def test_named_captures_into
+    date = Struct.new(:wday, :month, :day, :year)
+    s = create_string_scanner("Fri Dec 12 1975 14:39")
+    s.scan(/(?<wday>\w+) (?<month>\w+) (?<day>\d+) /)
+    d = date.new(nil, nil, nil, "1975")
+    assert_same(d, s.named_captures_into(d))
+    assert_equal(date.new("Fri", "Dec", "12", "1975"), d)
+    s.scan(/(?<month>\d+)/)
+    assert_equal(date.new("Fri", "1975", "12", "1975"), s.named_captures_into(d))
+    assert_raise(TypeError) { s.named_captures_into({}) }
+  end
+
   def test_fixed_anchor_true
     assert_equal(true,  StringScanner.new("a", fixed_anchor: true).fixed_anchor?)
   end
@@ -769,4 +1693,47 @@ class TestStringScannerFixedAnchor < TestStringScanner
     assert_equal 1, s.skip(/a/)
     assert_nil      s.skip(/^b/)
   end
+
+  def test_lookbehind_window
+    s = StringScanner.new("key: value", fixed_anchor: true, lookbehind_window: 2)
+    assert_equal(2, s.lookbehind_window)
+    s.pos = 5
+    assert_equal("value", s.scan(/(?<=: )\w+/))
+    s.pos = 5
+    assert_nil(s.scan(/(?<=key: )\w+/))
+    s.pos = 5
+    assert_equal("value", s.scan(/(?<=: )(\w)(\w+)/))
+    assert_equal(["v", "alue"], s.captures)
+    assert_equal("key: ", s.pre_match)
+    assert_nil(StringScanner.new("a", fixed_anchor: true).lookbehind_window)
+  end
+
+  def test_lookbehind_window_anchors
+    s = StringScanner.new("ab\ncd", fixed_anchor: true, lookbehind_window: 0)
+    s.pos = 1
+    assert_nil(s.skip(/\Ab/))
+    assert_nil(s.skip(/^b/))
+    assert_equal(3, s.skip_until(/^c/))
+    assert_equal(4, s.pos)
+    assert_equal("ab\n", s.pre_match)
+  end
+
+  def test_lookbehind_window_multibyte
+    s = StringScanner.new("\u3042\u3044\u3046", fixed_anchor: true, lookbehind_window: 2)
+    s.pos = 6
+    assert_equal("\u3046", s.scan(/(?<=\u3044)./))
+  end
+
+  def test_lookbehind_window_requires_fixed_anchor
+    assert_raise(ArgumentError) { StringScanner.new("a", lookbehind_window: 1) }
+    assert_raise(ArgumentError) do
+      StringScanner.new("a", fixed_anchor: true, lookbehind_window: -1)
+    end
+  end
+end
+
+class TestStringScannerLookbehindWindow < TestStringScannerFixedAnchor
+  def create_string_scanner(string, *args)
+    StringScanner.new(string, fixed_anchor: true, lookbehind_window: 1)
+  end
 end